@@ -21,8 +21,18 @@
 #include <linux/poll.h>
 #include <linux/kfifo.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/idr.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/bitmap.h>
+#include <linux/io.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/scatterlist.h>
+#include <linux/eventfd.h>
 #include "mostcore.h"
+#include "most_cdev.h"
 
 static dev_t aim_devno;
 static struct class *aim_class;
@@ -30,6 +40,14 @@ static struct ida minor_id;
 static unsigned int major;
 static struct most_aim cdev_aim;
 
+static unsigned int bcast_readers;
+module_param(bcast_readers, uint, 0644);
+MODULE_PARM_DESC(bcast_readers, "Additional read-only openers allowed per Rx channel, each getting all data (default: 0)");
+
+static unsigned int bcast_lag = 8;
+module_param(bcast_lag, uint, 0644);
+MODULE_PARM_DESC(bcast_lag, "Buffers an additional reader may lag behind before it loses the oldest (default: 8)");
+
 struct aim_channel {
 	wait_queue_head_t wq;
 	spinlock_t unlink;	/* synchronization lock to unlink channels */
@@ -44,6 +62,63 @@ struct aim_channel {
 	DECLARE_KFIFO_PTR(fifo, typeof(struct mbo *));
 	int access_ref;
 	struct list_head list;
+
+	/* mmap ring mode */
+	spinlock_t ring_lock;	/* ring state vs. completion handlers */
+	struct most_cdev_ring *ring;
+	bool ring_mode;
+	struct mbo **ring_mbo;
+	u16 *ring_slot;
+	unsigned long *ring_owned;
+	u32 ring_head;
+	u32 ring_tail;
+	u32 ring_bytes;
+	struct address_space *ring_mapping;
+
+	/* Rx wakeup coalescing */
+	u32 wake_bytes;
+	u32 wake_buffers;
+	ktime_t wake_delay;
+	struct hrtimer wake_timer;
+	atomic_t rx_bytes;
+	bool wake_expired;
+
+	bool direct_tx;
+	bool direct_busy;
+	bool rx_tstamp;
+
+	/* completion notification of an event loop */
+	spinlock_t ev_lock;
+	struct eventfd_ctx *evfd;
+	atomic_t ev_pending;
+
+	/* broadcast readers besides the first opener */
+	struct list_head readers;
+	unsigned int num_readers;
+	atomic_t *mbo_refs;
+};
+
+/**
+ * struct aim_reader - additional reader of an Rx channel
+ * @c: channel read from
+ * @list: list head for the readers of the channel
+ * @fifo: received MBOs not yet read
+ * @cur: MBO currently being read
+ * @offs: read offset within @cur
+ * @lag: number of queued MBOs after which the oldest one is dropped
+ * @stopped: the reader has released its MBOs and the channel
+ *
+ * Every reader holds a reference to the MBOs it has been given.  The MBO
+ * goes back to the core when the last holder has consumed it.
+ */
+struct aim_reader {
+	struct aim_channel *c;
+	struct list_head list;
+	DECLARE_KFIFO_PTR(fifo, typeof(struct mbo *));
+	struct mbo *cur;
+	size_t offs;
+	unsigned int lag;
+	bool stopped;
 };
 
 #define to_channel(d) container_of(d, struct aim_channel, cdev)
@@ -55,6 +130,15 @@ static inline bool ch_has_mbo(struct aim_channel *c)
 	return channel_has_mbo(c->iface, c->channel_id, &cdev_aim) > 0;
 }
 
+/*
+ * read() and write() are off from the moment the ring is allocated, as
+ * aim_mmap() may still wait for the Tx buffers before ring_mode is set
+ */
+static inline bool ch_ring_busy(struct aim_channel *c)
+{
+	return c->ring;
+}
+
 static inline bool ch_get_mbo(struct aim_channel *c, struct mbo **mbo)
 {
 	if (!kfifo_peek(&c->fifo, mbo)) {
@@ -65,6 +149,115 @@ static inline bool ch_get_mbo(struct aim_channel *c, struct mbo **mbo)
 	return *mbo;
 }
 
+/**
+ * rx_ready - checks whether Rx data is worth a wakeup
+ * @c: pointer to channel object
+ * @buffers: number of buffers waiting for the reader
+ * @bytes: number of bytes waiting for the reader
+ *
+ * Data is ready once it reaches both thresholds or the coalescing delay
+ * has expired.
+ */
+static inline bool rx_ready(struct aim_channel *c, unsigned int buffers,
+			    unsigned int bytes)
+{
+	if (!buffers)
+		return false;
+	return READ_ONCE(c->wake_expired) ||
+	       (buffers >= c->wake_buffers && bytes >= c->wake_bytes);
+}
+
+static inline bool ch_rx_ready(struct aim_channel *c)
+{
+	return rx_ready(c, kfifo_len(&c->fifo), atomic_read(&c->rx_bytes));
+}
+
+/* adds n to the counter of the registered eventfd, if any */
+static void ch_signal(struct aim_channel *c, unsigned int n)
+{
+	unsigned long flags;
+
+	if (!n)
+		return;
+	spin_lock_irqsave(&c->ev_lock, flags);
+	if (c->evfd)
+		eventfd_signal(c->evfd, n);
+	spin_unlock_irqrestore(&c->ev_lock, flags);
+}
+
+/* replaces the registered eventfd, fd < 0 only removes it */
+static int ch_set_eventfd(struct aim_channel *c, int fd)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+	unsigned long flags;
+
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+	spin_lock_irqsave(&c->ev_lock, flags);
+	old = c->evfd;
+	c->evfd = ctx;
+	atomic_set(&c->ev_pending, 0);
+	spin_unlock_irqrestore(&c->ev_lock, flags);
+	if (old)
+		eventfd_ctx_put(old);
+	return 0;
+}
+
+/*
+ * rx_notify - wakes the reader or arms the coalescing timer, called by
+ * the Rx completion with the lock protecting the queue held
+ *
+ * The eventfd is signalled with the number of buffers received since the
+ * last wakeup, so it obeys the same thresholds as the reader.
+ */
+static void rx_notify(struct aim_channel *c, bool ready)
+{
+	atomic_inc(&c->ev_pending);
+	if (ready) {
+		hrtimer_try_to_cancel(&c->wake_timer);
+		ch_signal(c, atomic_xchg(&c->ev_pending, 0));
+		wake_up_interruptible(&c->wq);
+	} else if (c->wake_delay && !c->wake_expired &&
+		   !hrtimer_active(&c->wake_timer)) {
+		hrtimer_start(&c->wake_timer, c->wake_delay, HRTIMER_MODE_REL);
+	}
+}
+
+static enum hrtimer_restart wake_timer_fn(struct hrtimer *t)
+{
+	struct aim_channel *c = container_of(t, struct aim_channel,
+					     wake_timer);
+
+	WRITE_ONCE(c->wake_expired, true);
+	ch_signal(c, atomic_xchg(&c->ev_pending, 0));
+	wake_up_interruptible(&c->wq);
+	return HRTIMER_NORESTART;
+}
+
+/* drops a reference to a received MBO, the last holder returns it */
+static void ch_put_rx_mbo(struct aim_channel *c, struct mbo *mbo)
+{
+	if (!c->mbo_refs || atomic_dec_and_test(&c->mbo_refs[mbo->index]))
+		most_put_mbo(mbo);
+}
+
+/* hands a consumed Rx buffer back, called with io_mutex held */
+static void rx_release(struct aim_channel *c, struct mbo *mbo)
+{
+	unsigned long flags;
+
+	kfifo_skip(&c->fifo);
+	atomic_sub(mbo->processed_length, &c->rx_bytes);
+	spin_lock_irqsave(&c->unlink, flags);
+	if (kfifo_is_empty(&c->fifo))
+		c->wake_expired = false;
+	spin_unlock_irqrestore(&c->unlink, flags);
+	ch_put_rx_mbo(c, mbo);
+}
+
 static struct aim_channel *get_channel(struct most_interface *iface, int id)
 {
 	struct aim_channel *c, *tmp;
@@ -84,13 +277,74 @@ static struct aim_channel *get_channel(struct most_interface *iface, int id)
 	return c;
 }
 
+/* starts the channel for another opener, called with io_mutex held */
+static int ch_start(struct aim_channel *c)
+{
+	int ret;
+
+	if (c->cfg->direction == MOST_CH_RX && !c->mbo_refs) {
+		c->mbo_refs = kcalloc(c->cfg->num_buffers,
+				      sizeof(*c->mbo_refs), GFP_KERNEL);
+		if (!c->mbo_refs)
+			return -ENOMEM;
+	}
+	ret = most_start_channel(c->iface, c->channel_id, &cdev_aim);
+	if (ret && !c->access_ref && !c->num_readers) {
+		kfree(c->mbo_refs);
+		c->mbo_refs = NULL;
+	}
+	return ret;
+}
+
+/*
+ * stops the channel for an opener that has returned its MBOs, called with
+ * io_mutex held
+ */
+static void ch_stop(struct aim_channel *c)
+{
+	most_stop_channel(c->iface, c->channel_id, &cdev_aim);
+	if (!c->access_ref && !c->num_readers) {
+		kfree(c->mbo_refs);
+		c->mbo_refs = NULL;
+	}
+}
+
+static void ring_free(struct aim_channel *c);
+
 static void stop_channel(struct aim_channel *c)
 {
 	struct mbo *mbo;
 
+	ring_free(c);
+	hrtimer_cancel(&c->wake_timer);
 	while (kfifo_out((struct kfifo *)&c->fifo, &mbo, 1))
-		most_put_mbo(mbo);
-	most_stop_channel(c->iface, c->channel_id, &cdev_aim);
+		ch_put_rx_mbo(c, mbo);
+	atomic_set(&c->rx_bytes, 0);
+	c->wake_expired = false;
+	ch_set_eventfd(c, -1);
+	ch_stop(c);
+}
+
+/* releases the MBOs of a broadcast reader, called with io_mutex held */
+static void reader_stop(struct aim_reader *r)
+{
+	struct aim_channel *c = r->c;
+	unsigned long flags;
+	struct mbo *mbo;
+
+	if (r->stopped)
+		return;
+	r->stopped = true;
+
+	spin_lock_irqsave(&c->unlink, flags);
+	list_del(&r->list);
+	while (kfifo_out(&r->fifo, &mbo, 1))
+		ch_put_rx_mbo(c, mbo);
+	if (r->cur)
+		ch_put_rx_mbo(c, r->cur);
+	r->cur = NULL;
+	spin_unlock_irqrestore(&c->unlink, flags);
+	ch_stop(c);
 }
 
 static void destroy_cdev(struct aim_channel *c)
@@ -107,10 +361,58 @@ static void destroy_cdev(struct aim_channel *c)
 static void destroy_channel(struct aim_channel *c)
 {
 	ida_simple_remove(&minor_id, MINOR(c->devno));
+	if (c->evfd)
+		eventfd_ctx_put(c->evfd);
 	kfifo_free(&c->fifo);
+	kfree(c->mbo_refs);
 	kfree(c);
 }
 
+static const struct file_operations reader_fops;
+
+/**
+ * reader_open - opens an Rx channel as additional broadcast reader
+ * @c: pointer to channel object
+ * @filp: file pointer
+ *
+ * Called with io_mutex held.
+ */
+static int reader_open(struct aim_channel *c, struct file *filp)
+{
+	struct aim_reader *r;
+	unsigned long flags;
+	int ret;
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+	ret = kfifo_alloc(&r->fifo, c->cfg->num_buffers, GFP_KERNEL);
+	if (ret)
+		goto err_free;
+	r->c = c;
+	r->lag = clamp_t(unsigned int, bcast_lag, 1, c->cfg->num_buffers);
+
+	ret = ch_start(c);
+	if (ret)
+		goto err_fifo;
+
+	c->num_readers++;
+	spin_lock_irqsave(&c->unlink, flags);
+	list_add_tail(&r->list, &c->readers);
+	spin_unlock_irqrestore(&c->unlink, flags);
+
+	filp->private_data = r;
+	replace_fops(filp, fops_get(&reader_fops));
+	filp->f_mode |= FMODE_NOWAIT;
+	return 0;
+
+err_fifo:
+	kfifo_free(&r->fifo);
+err_free:
+	kfree(r);
+	return ret;
+}
+
 /**
  * aim_open - implements the syscall to open the device
  * @inode: inode pointer
@@ -127,10 +429,11 @@ static int aim_open(struct inode *inode, struct file *filp)
 	c = to_channel(inode->i_cdev);
 	filp->private_data = c;
 
+	/* O_RDWR is needed to map the ring of either direction */
 	if (((c->cfg->direction == MOST_CH_RX) &&
-	     ((filp->f_flags & O_ACCMODE) != O_RDONLY)) ||
+	     ((filp->f_flags & O_ACCMODE) == O_WRONLY)) ||
 	     ((c->cfg->direction == MOST_CH_TX) &&
-		((filp->f_flags & O_ACCMODE) != O_WRONLY))) {
+		((filp->f_flags & O_ACCMODE) == O_RDONLY))) {
 		pr_info("WARN: Access flags mismatch\n");
 		return -EACCES;
 	}
@@ -143,15 +446,29 @@ static int aim_open(struct inode *inode, struct file *filp)
 	}
 
 	if (c->access_ref) {
+		if (c->cfg->direction == MOST_CH_RX &&
+		    (filp->f_flags & O_ACCMODE) == O_RDONLY &&
+		    c->num_readers < bcast_readers && !c->ring_mode) {
+			ret = reader_open(c, filp);
+			mutex_unlock(&c->io_mutex);
+			return ret;
+		}
 		pr_info("WARN: Device is busy\n");
 		mutex_unlock(&c->io_mutex);
 		return -EBUSY;
 	}
 
 	c->mbo_offs = 0;
-	ret = most_start_channel(c->iface, c->channel_id, &cdev_aim);
-	if (!ret)
+	c->wake_bytes = 0;
+	c->wake_buffers = 1;
+	c->wake_delay = 0;
+	c->direct_tx = false;
+	c->rx_tstamp = false;
+	ret = ch_start(c);
+	if (!ret) {
 		c->access_ref = 1;
+		filp->f_mode |= FMODE_NOWAIT;
+	}
 	mutex_unlock(&c->io_mutex);
 	return ret;
 }
@@ -174,6 +491,8 @@ static int aim_close(struct inode *inode, struct file *filp)
 	if (c->dev) {
 		stop_channel(c);
 		mutex_unlock(&c->io_mutex);
+	} else if (c->num_readers) {
+		mutex_unlock(&c->io_mutex);
 	} else {
 		mutex_unlock(&c->io_mutex);
 		destroy_channel(c);
@@ -181,110 +500,1118 @@ static int aim_close(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+static inline bool ch_is_stream(struct aim_channel *c)
+{
+	return c->cfg->data_type != MOST_CH_CONTROL &&
+	       c->cfg->data_type != MOST_CH_ASYNC;
+}
+
+/* neither the I/O lock nor buffer space may be waited for */
+static inline bool io_nowait(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+	       (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static inline bool io_lock(struct aim_channel *c, struct kiocb *iocb)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return mutex_trylock(&c->io_mutex);
+	mutex_lock(&c->io_mutex);
+	return true;
+}
+
+/* Tx buffer whose payload lives in pinned user pages */
+struct direct_xfer {
+	struct mbo *mbo;
+	struct sg_table sgt;
+	struct page **pages;
+	unsigned int num_pages;
+};
+
+static inline unsigned int direct_pages_per_mbo(struct aim_channel *c)
+{
+	return DIV_ROUND_UP(c->cfg->buffer_size, PAGE_SIZE) + 1;
+}
+
+/*
+ * checks whether the HDM is done with the pages of a batch, which it is
+ * at the latest once the channel is gone.  The MBOs are freed when the
+ * channel stops, so they are only looked at under unlink while the
+ * device is still there.
+ */
+static bool direct_done(struct aim_channel *c, struct direct_xfer *x,
+			unsigned int num)
+{
+	unsigned long flags;
+	bool done = true;
+
+	spin_lock_irqsave(&c->unlink, flags);
+	while (c->dev && done && num--)
+		done = !READ_ONCE(x[num].mbo->sgt);
+	spin_unlock_irqrestore(&c->unlink, flags);
+	return done;
+}
+
+static void direct_put_pages(struct direct_xfer *x)
+{
+	while (x->num_pages--)
+		put_page(x->pages[x->num_pages]);
+}
+
 /**
- * aim_write - implements the syscall to write to the device
- * @filp: file pointer
- * @buf: pointer to user buffer
- * @count: number of bytes to write
- * @offset: offset from where to start writing
+ * direct_write - transmits user pages without copying them
+ * @c: pointer to channel object
+ * @from: source of the data
+ *
+ * The pages of a batch of MBOs are pinned and passed to the HDM in
+ * mbo->sgt.  The core clears mbo->sgt on completion, which releases the
+ * pages.  Only full MBOs that lie within one iovec segment go this way,
+ * the caller copies whatever is left.  Called with io_mutex held and at
+ * least one MBO available, io_mutex is dropped while the batch is in
+ * flight.  Other writers wait for direct_busy meanwhile, so that they
+ * neither take MBOs nor interleave their data.
+ *
+ * Returns the number of bytes written or error code.
  */
-static ssize_t aim_write(struct file *filp, const char __user *buf,
-			 size_t count, loff_t *offset)
+static ssize_t direct_write(struct aim_channel *c, struct iov_iter *from)
 {
-	int ret;
-	size_t to_copy, left;
+	unsigned int per_mbo = direct_pages_per_mbo(c);
+	unsigned int max = c->cfg->num_buffers;
+	struct direct_xfer *x;
+	struct page **pages;
+	struct mbo *mbo;
+	ssize_t total = 0;
+	ssize_t bytes;
+	unsigned int i, num;
+	size_t start;
+	int ret = 0;
+
+	x = kcalloc(max, sizeof(*x), GFP_KERNEL);
+	pages = kmalloc_array(max * per_mbo, sizeof(*pages), GFP_KERNEL);
+	if (!x || !pages) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	num = 0;
+	while (num < max &&
+	       iov_iter_single_seg_count(from) >= c->cfg->buffer_size &&
+	       ch_get_mbo(c, &mbo)) {
+		struct direct_xfer *xi = x + num;
+
+		xi->pages = pages + num * per_mbo;
+		bytes = iov_iter_get_pages(from, xi->pages,
+					   c->cfg->buffer_size, per_mbo,
+					   &start);
+		if (bytes <= 0) {
+			ret = bytes ? bytes : -EFAULT;
+			break;
+		}
+		xi->num_pages = DIV_ROUND_UP(start + bytes, PAGE_SIZE);
+		/* a short MBO would break the frame alignment of the stream */
+		if (bytes != c->cfg->buffer_size) {
+			direct_put_pages(xi);
+			break;
+		}
+		if (sg_alloc_table_from_pages(&xi->sgt, xi->pages,
+					      xi->num_pages, start,
+					      bytes, GFP_KERNEL)) {
+			direct_put_pages(xi);
+			ret = -ENOMEM;
+			break;
+		}
+		iov_iter_advance(from, bytes);
+
+		kfifo_skip(&c->fifo);
+		xi->mbo = mbo;
+		mbo->buffer_length = bytes;
+		mbo->sgt = &xi->sgt;
+		most_submit_mbo(mbo);
+		total += bytes;
+		num++;
+	}
+	if (!num)
+		goto out;
+
+	/*
+	 * The pages belong to the HDM until its MBOs are back.  A disconnect
+	 * takes io_mutex to stop the channel, which returns all MBOs.  Even
+	 * a writer that is killed has to wait for its pages, but it submits
+	 * nothing else.
+	 */
+	c->direct_busy = true;
+	mutex_unlock(&c->io_mutex);
+	if (wait_event_killable(c->wq, direct_done(c, x, num)))
+		wait_event(c->wq, direct_done(c, x, num));
+	mutex_lock(&c->io_mutex);
+	for (i = 0; i < num; i++) {
+		sg_free_table(&x[i].sgt);
+		direct_put_pages(x + i);
+	}
+	c->direct_busy = false;
+	wake_up(&c->wq);
+out:
+	kfree(pages);
+	kfree(x);
+	return total ? total : ret;
+}
+
+static inline bool direct_ok(struct aim_channel *c, struct kiocb *iocb,
+			     struct iov_iter *from)
+{
+	return c->direct_tx && c->cfg->dma_sg && ch_is_stream(c) &&
+	       !c->mbo_offs && iter_is_iovec(from) &&
+	       !(iocb->ki_flags & IOCB_NOWAIT) &&
+	       iov_iter_single_seg_count(from) >= c->cfg->buffer_size;
+}
+
+/**
+ * aim_write_iter - implements the syscalls to write to the device
+ * @iocb: I/O control block
+ * @from: source of the data
+ *
+ * Streaming channels fill as many MBOs as the request covers and only
+ * block for the first one.  Control and async channels submit one
+ * message per call.  Requests with IOCB_NOWAIT (AIO, io_uring) do not
+ * block at all and fail with -EAGAIN instead.  If direct Tx is enabled,
+ * full buffers are transmitted from the user pages and only the rest is
+ * copied.
+ */
+static ssize_t aim_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *filp = iocb->ki_filp;
+	struct aim_channel *c = filp->private_data;
+	size_t to_copy, copied;
 	struct mbo *mbo = NULL;
+	ssize_t total = 0;
+	ssize_t ret;
+
+	if (!io_lock(c, iocb))
+		return -EAGAIN;
+	if (c->dev && c->cfg->direction != MOST_CH_TX) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	if (ch_ring_busy(c)) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	while (iov_iter_count(from)) {
+		while (c->dev && (c->direct_busy || !ch_get_mbo(c, &mbo))) {
+			if (total)
+				goto out;
+			mutex_unlock(&c->io_mutex);
+
+			if (io_nowait(iocb))
+				return -EAGAIN;
+			if (wait_event_interruptible(c->wq,
+						     (!c->direct_busy &&
+						      ch_has_mbo(c)) ||
+						     ch_ring_busy(c) ||
+						     !c->dev))
+				return -ERESTARTSYS;
+			mutex_lock(&c->io_mutex);
+			if (ch_ring_busy(c)) {
+				ret = -EBUSY;
+				goto unlock;
+			}
+		}
+
+		if (unlikely(!c->dev)) {
+			ret = -ENODEV;
+			goto unlock;
+		}
+
+		if (direct_ok(c, iocb, from)) {
+			ret = direct_write(c, from);
+			if (ret < 0) {
+				if (!total)
+					goto unlock;
+				break;
+			}
+			total += ret;
+			/* io_mutex was dropped, the ring may have come */
+			if (fatal_signal_pending(current) || ch_ring_busy(c))
+				break;
+			continue;
+		}
+
+		to_copy = min_t(size_t, iov_iter_count(from),
+				c->cfg->buffer_size - c->mbo_offs);
+		copied = copy_from_iter(mbo->virt_address + c->mbo_offs,
+					to_copy, from);
+		if (!copied) {
+			if (!total) {
+				ret = -EFAULT;
+				goto unlock;
+			}
+			break;
+		}
+
+		c->mbo_offs += copied;
+		total += copied;
+		if (c->mbo_offs >= c->cfg->buffer_size || !ch_is_stream(c)) {
+			kfifo_skip(&c->fifo);
+			mbo->buffer_length = c->mbo_offs;
+			c->mbo_offs = 0;
+			most_submit_mbo(mbo);
+		}
+		if (!ch_is_stream(c) || copied < to_copy)
+			break;
+	}
+out:
+	ret = total;
+unlock:
+	mutex_unlock(&c->io_mutex);
+	return ret;
+}
+
+/**
+ * aim_read_iter - implements the syscalls to read from the device
+ * @iocb: I/O control block
+ * @to: destination of the data
+ *
+ * Streaming channels drain as many MBOs as the request covers and only
+ * block for the first one.  Control and async channels return at most
+ * one message per call.  Requests with IOCB_NOWAIT do not block at all.
+ */
+static ssize_t aim_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
 	struct aim_channel *c = filp->private_data;
+	size_t to_copy, copied;
+	struct mbo *mbo;
+	ssize_t total = 0;
+	ssize_t ret;
+
+	if (!io_lock(c, iocb))
+		return -EAGAIN;
+	if (c->dev && c->cfg->direction != MOST_CH_RX) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	if (ch_ring_busy(c)) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	while (iov_iter_count(to)) {
+		while (c->dev && (!kfifo_peek(&c->fifo, &mbo) ||
+				  (!total && !ch_rx_ready(c)))) {
+			if (total)
+				goto out;
+			mutex_unlock(&c->io_mutex);
+			if (io_nowait(iocb))
+				return -EAGAIN;
+			if (wait_event_interruptible(c->wq,
+						     (ch_rx_ready(c) ||
+						      ch_ring_busy(c) ||
+						      (!c->dev))))
+				return -ERESTARTSYS;
+			mutex_lock(&c->io_mutex);
+			if (ch_ring_busy(c)) {
+				ret = -EBUSY;
+				goto unlock;
+			}
+		}
+
+		/* make sure we don't submit to gone devices */
+		if (unlikely(!c->dev)) {
+			ret = -ENODEV;
+			goto unlock;
+		}
+
+		to_copy = min_t(size_t, iov_iter_count(to),
+				mbo->processed_length - c->mbo_offs);
+		copied = copy_to_iter(mbo->virt_address + c->mbo_offs,
+				      to_copy, to);
+
+		c->mbo_offs += copied;
+		total += copied;
+		if (c->mbo_offs >= mbo->processed_length) {
+			rx_release(c, mbo);
+			c->mbo_offs = 0;
+		}
+		if (!ch_is_stream(c) || copied < to_copy)
+			break;
+	}
+out:
+	ret = total;
+unlock:
+	mutex_unlock(&c->io_mutex);
+	return ret;
+}
+
+/**
+ * reader_read_iter - implements the syscalls to read as broadcast reader
+ * @iocb: I/O control block
+ * @to: destination of the data
+ */
+static ssize_t reader_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct aim_reader *r = iocb->ki_filp->private_data;
+	struct aim_channel *c = r->c;
+	size_t to_copy, copied;
+	unsigned long flags;
+	ssize_t total = 0;
+	ssize_t ret;
+
+	if (!io_lock(c, iocb))
+		return -EAGAIN;
+
+	while (iov_iter_count(to)) {
+		while (c->dev && !r->cur) {
+			spin_lock_irqsave(&c->unlink, flags);
+			if (kfifo_out(&r->fifo, &r->cur, 1))
+				r->offs = 0;
+			spin_unlock_irqrestore(&c->unlink, flags);
+			if (r->cur)
+				break;
+			if (total)
+				goto out;
+			mutex_unlock(&c->io_mutex);
+			if (io_nowait(iocb))
+				return -EAGAIN;
+			if (wait_event_interruptible(c->wq,
+						     (!kfifo_is_empty(&r->fifo) ||
+						      (!c->dev))))
+				return -ERESTARTSYS;
+			mutex_lock(&c->io_mutex);
+		}
+
+		if (unlikely(!c->dev)) {
+			ret = total ? total : -ENODEV;
+			goto unlock;
+		}
+
+		to_copy = min_t(size_t, iov_iter_count(to),
+				r->cur->processed_length - r->offs);
+		copied = copy_to_iter(r->cur->virt_address + r->offs,
+				      to_copy, to);
+		r->offs += copied;
+		total += copied;
+		if (r->offs >= r->cur->processed_length) {
+			ch_put_rx_mbo(c, r->cur);
+			r->cur = NULL;
+		}
+		if (!ch_is_stream(c) || copied < to_copy)
+			break;
+	}
+out:
+	ret = total;
+unlock:
+	mutex_unlock(&c->io_mutex);
+	return ret;
+}
+
+static unsigned int reader_poll(struct file *filp, poll_table *wait)
+{
+	struct aim_reader *r = filp->private_data;
+	struct aim_channel *c = r->c;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &c->wq, wait);
+
+	if (r->cur || !kfifo_is_empty(&r->fifo))
+		mask |= POLLIN | POLLRDNORM;
+	if (!c->dev)
+		mask |= POLLHUP;
+	return mask;
+}
+
+static int reader_release(struct inode *inode, struct file *filp)
+{
+	struct aim_reader *r = filp->private_data;
+	struct aim_channel *c = r->c;
+	bool destroy;
 
 	mutex_lock(&c->io_mutex);
-	while (c->dev && !ch_get_mbo(c, &mbo)) {
-		mutex_unlock(&c->io_mutex);
+	c->num_readers--;
+	reader_stop(r);
+	destroy = !c->dev && !c->access_ref && !c->num_readers;
+	mutex_unlock(&c->io_mutex);
 
-		if ((filp->f_flags & O_NONBLOCK))
-			return -EAGAIN;
-		if (wait_event_interruptible(c->wq, ch_has_mbo(c) || !c->dev))
-			return -ERESTARTSYS;
-		mutex_lock(&c->io_mutex);
+	kfifo_free(&r->fifo);
+	kfree(r);
+	if (destroy)
+		destroy_channel(c);
+	return 0;
+}
+
+static const struct file_operations reader_fops = {
+	.owner = THIS_MODULE,
+	.read_iter = reader_read_iter,
+	.splice_read = generic_file_splice_read,
+	.release = reader_release,
+	.poll = reader_poll,
+};
+
+/*
+ * mmap ring mode
+ *
+ * The mapping starts with the control area (struct most_cdev_ring)
+ * followed by the buffers of all MBOs of the channel, ordered by their
+ * index.  Ownership of a buffer moves between driver and application by
+ * means of the head and tail counters only, hence no data is copied.
+ *
+ * ring_head and ring_tail are the driver's copies of the counters.  Rx:
+ * entries [ring_tail, ring_head) are owned by the application and
+ * ring_slot maps them to MBO indices.  Tx: entries [ring_tail, ring_head)
+ * have been submitted, ring_owned flags the buffers held by the driver.
+ * Counters and entries read from the shared area are never trusted.
+ */
+static inline u32 ring_slot_size(struct aim_channel *c)
+{
+	return PAGE_ALIGN(c->cfg->buffer_size + c->cfg->extra_len);
+}
+
+static inline size_t ring_ctrl_size(struct aim_channel *c)
+{
+	return PAGE_ALIGN(sizeof(struct most_cdev_ring) +
+			  c->cfg->num_buffers *
+			  sizeof(struct most_cdev_ring_desc));
+}
+
+static int ring_alloc(struct aim_channel *c)
+{
+	unsigned int n = c->cfg->num_buffers;
+
+	c->ring = alloc_pages_exact(ring_ctrl_size(c),
+				    GFP_KERNEL | __GFP_ZERO);
+	c->ring_mbo = kcalloc(n, sizeof(*c->ring_mbo), GFP_KERNEL);
+	c->ring_slot = kcalloc(n, sizeof(*c->ring_slot), GFP_KERNEL);
+	c->ring_owned = kcalloc(BITS_TO_LONGS(n), sizeof(long), GFP_KERNEL);
+	c->ring_head = 0;
+	c->ring_tail = 0;
+	c->ring_bytes = 0;
+	if (!c->ring || !c->ring_mbo || !c->ring_slot || !c->ring_owned) {
+		if (c->ring)
+			free_pages_exact(c->ring, ring_ctrl_size(c));
+		kfree(c->ring_mbo);
+		kfree(c->ring_slot);
+		kfree(c->ring_owned);
+		c->ring = NULL;
+		return -ENOMEM;
 	}
+	return 0;
+}
+
+/**
+ * ring_free - leaves ring mode and hands all buffers back to the core
+ * @c: pointer to channel object
+ *
+ * Must be called with io_mutex held.  Mappings still around are zapped,
+ * so the application gets SIGBUS instead of touching freed buffers.
+ */
+static void ring_free(struct aim_channel *c)
+{
+	unsigned int n = c->cfg->num_buffers;
+	unsigned long flags;
+	unsigned int i;
+
+	if (!c->ring)
+		return;
+
+	if (c->ring_mapping)
+		unmap_mapping_range(c->ring_mapping, 0, 0, 1);
+	c->ring_mapping = NULL;
+
+	spin_lock_irqsave(&c->ring_lock, flags);
+	c->ring_mode = false;
+	if (c->cfg->direction == MOST_CH_RX) {
+		for (; c->ring_tail != c->ring_head; c->ring_tail++) {
+			i = c->ring_slot[c->ring_tail % n];
+			most_put_mbo(c->ring_mbo[i]);
+		}
+	} else {
+		for_each_set_bit(i, c->ring_owned, n)
+			most_put_mbo(c->ring_mbo[i]);
+	}
+	spin_unlock_irqrestore(&c->ring_lock, flags);
+
+	free_pages_exact(c->ring, ring_ctrl_size(c));
+	kfree(c->ring_mbo);
+	kfree(c->ring_slot);
+	kfree(c->ring_owned);
+	c->ring = NULL;
+	c->ring_mbo = NULL;
+	c->ring_slot = NULL;
+	c->ring_owned = NULL;
+}
+
+/* Rx: publishes a received buffer, called with ring_lock held */
+static void ring_produce(struct aim_channel *c, struct mbo *mbo)
+{
+	unsigned int i = c->ring_head % c->cfg->num_buffers;
+
+	c->ring_mbo[mbo->index] = mbo;
+	c->ring_slot[i] = mbo->index;
+	c->ring_bytes += mbo->processed_length;
+	c->ring->desc[i].slot = mbo->index;
+	c->ring->desc[i].length = mbo->processed_length;
+	smp_wmb(); /* entry before head */
+	WRITE_ONCE(c->ring->head, ++c->ring_head);
+}
+
+/* Tx: collects transmitted buffers, called with ring_lock held */
+static void ring_reclaim_tx(struct aim_channel *c)
+{
+	unsigned int n = c->cfg->num_buffers;
+	struct mbo *mbo;
+
+	while ((mbo = most_get_mbo(c->iface, c->channel_id, &cdev_aim))) {
+		c->ring_mbo[mbo->index] = mbo;
+		set_bit(mbo->index, c->ring_owned);
+	}
+	while (c->ring_tail != c->ring_head &&
+	       test_bit(c->ring_tail % n, c->ring_owned))
+		c->ring_tail++;
+	smp_wmb(); /* buffer ownership before tail */
+	WRITE_ONCE(c->ring->tail, c->ring_tail);
+}
+
+/**
+ * ring_sync - picks up the counter the application has advanced
+ * @c: pointer to channel object
+ *
+ * Rx buffers released by the application are returned to the core, Tx
+ * buffers filled by the application are submitted.  Called with ring_lock
+ * held.
+ *
+ * Returns 0 on success or -EINVAL if the shared area has been corrupted.
+ */
+static int ring_sync(struct aim_channel *c)
+{
+	unsigned int n = c->cfg->num_buffers;
+	struct mbo *mbo;
+	unsigned int i;
+	u32 len;
+	u32 cnt;
 
-	if (unlikely(!c->dev)) {
+	if (c->cfg->direction == MOST_CH_RX) {
+		cnt = READ_ONCE(c->ring->tail);
+		if (cnt - c->ring_tail > c->ring_head - c->ring_tail)
+			return -EINVAL;
+		for (; c->ring_tail != cnt; c->ring_tail++) {
+			i = c->ring_slot[c->ring_tail % n];
+			c->ring_bytes -= c->ring_mbo[i]->processed_length;
+			most_put_mbo(c->ring_mbo[i]);
+		}
+		if (c->ring_tail == c->ring_head)
+			c->wake_expired = false;
+		return 0;
+	}
+
+	ring_reclaim_tx(c);
+	cnt = READ_ONCE(c->ring->head);
+	if (cnt - c->ring_head > c->ring_tail + n - c->ring_head)
+		return -EINVAL;
+	smp_rmb(); /* head before entries */
+	for (; c->ring_head != cnt; c->ring_head++) {
+		i = c->ring_head % n;
+		len = READ_ONCE(c->ring->desc[i].length);
+		if (!len || len > c->cfg->buffer_size)
+			return -EINVAL;
+		mbo = c->ring_mbo[i];
+		clear_bit(i, c->ring_owned);
+		mbo->buffer_length = len;
+		most_submit_mbo(mbo);
+	}
+	return 0;
+}
+
+static unsigned int ring_poll(struct aim_channel *c)
+{
+	unsigned int mask = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&c->ring_lock, flags);
+	if (!c->ring_mode) {
+		mask = POLLERR;
+	} else if (ring_sync(c)) {
+		mask = POLLERR;
+	} else if (c->cfg->direction == MOST_CH_RX) {
+		if (rx_ready(c, c->ring_head - c->ring_tail, c->ring_bytes))
+			mask = POLLIN | POLLRDNORM;
+	} else {
+		if (c->ring_head - c->ring_tail < c->cfg->num_buffers)
+			mask = POLLOUT | POLLWRNORM;
+	}
+	spin_unlock_irqrestore(&c->ring_lock, flags);
+	return mask;
+}
+
+/**
+ * aim_mmap - implements the syscall to map the ring of the device
+ * @filp: file pointer
+ * @vma: virtual memory area
+ *
+ * This maps the control area and all buffers of the channel and switches
+ * the channel to ring mode until it is closed.  read() and write() are
+ * refused while in ring mode.  Tx channels wait for all of their buffers.
+ */
+/**
+ * ring_mmap_slots - maps the slots of an established ring
+ * @c: the channel, io_mutex held
+ * @vma: mapping at file offset ring_size covering all slots
+ *
+ * The slots are the buffers of the MBOs themselves, so mostcore maps them.
+ */
+static int ring_mmap_slots(struct aim_channel *c, struct vm_area_struct *vma)
+{
+	if (!c->ring)
+		return -EINVAL;
+	if (vma->vm_end - vma->vm_start !=
+	    c->cfg->num_buffers * ring_slot_size(c))
+		return -EINVAL;
+
+	vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND;
+	/* mostcore counts from the first slot, not from the file offset */
+	vma->vm_pgoff = 0;
+	return most_mmap_buffers(c->iface, c->channel_id, vma);
+}
+
+/**
+ * aim_mmap - maps the ring of a channel
+ *
+ * File offset 0 maps the control area, which switches the channel to ring
+ * mode.  File offset ring_size maps the slots afterwards.
+ */
+static int aim_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct aim_channel *c = filp->private_data;
+	unsigned long flags;
+	struct mbo *mbo;
+	unsigned int n;
+	unsigned int i;
+	size_t ctrl;
+	int ret;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	mutex_lock(&c->io_mutex);
+	if (!c->dev) {
 		ret = -ENODEV;
 		goto unlock;
 	}
+	n = c->cfg->num_buffers;
+	ctrl = ring_ctrl_size(c);
+	if (vma->vm_pgoff == ctrl >> PAGE_SHIFT) {
+		ret = ring_mmap_slots(c, vma);
+		goto unlock;
+	}
+	if (vma->vm_pgoff) {
+		ret = -EINVAL;
+		goto unlock;
+	}
 
-	to_copy = min(count, c->cfg->buffer_size - c->mbo_offs);
-	left = copy_from_user(mbo->virt_address + c->mbo_offs, buf, to_copy);
-	if (left == to_copy) {
-		ret = -EFAULT;
+	if (c->ring || c->mbo_offs || c->num_readers) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+	if (vma->vm_end - vma->vm_start != ctrl) {
+		ret = -EINVAL;
 		goto unlock;
 	}
 
-	c->mbo_offs += to_copy - left;
-	if (c->mbo_offs >= c->cfg->buffer_size ||
-	    c->cfg->data_type == MOST_CH_CONTROL ||
-	    c->cfg->data_type == MOST_CH_ASYNC) {
-		kfifo_skip(&c->fifo);
-		mbo->buffer_length = c->mbo_offs;
-		c->mbo_offs = 0;
-		most_submit_mbo(mbo);
+	ret = ring_alloc(c);
+	if (ret)
+		goto unlock;
+	/* readers and writers blocked in the meantime back off */
+	wake_up(&c->wq);
+
+	vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND;
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(c->ring) >> PAGE_SHIFT, ctrl,
+			      vma->vm_page_prot);
+	if (ret)
+		goto err_free;
+	c->ring_mapping = filp->f_mapping;
+
+	if (c->cfg->direction == MOST_CH_TX) {
+		for (i = 0; i < n; i++)
+			c->ring->desc[i].slot = i;
+		while (kfifo_out((struct kfifo *)&c->fifo, &mbo, 1)) {
+			c->ring_mbo[mbo->index] = mbo;
+			set_bit(mbo->index, c->ring_owned);
+		}
+		for (;;) {
+			while ((mbo = most_get_mbo(c->iface, c->channel_id,
+						   &cdev_aim))) {
+				c->ring_mbo[mbo->index] = mbo;
+				set_bit(mbo->index, c->ring_owned);
+			}
+			if (bitmap_full(c->ring_owned, n))
+				break;
+
+			/* buffers in flight will come back soon */
+			mutex_unlock(&c->io_mutex);
+			ret = wait_event_interruptible(c->wq, ch_has_mbo(c) ||
+						       !c->dev);
+			mutex_lock(&c->io_mutex);
+			if (!c->dev || !c->ring) {
+				ret = -ENODEV;
+				goto unlock;
+			}
+			if (ret)
+				goto err_free;
+		}
+	}
+
+	/* the Rx completion fills the kfifo under the same locks */
+	spin_lock_irqsave(&c->ring_lock, flags);
+	spin_lock(&c->unlink);
+	if (c->cfg->direction == MOST_CH_RX) {
+		while (kfifo_out((struct kfifo *)&c->fifo, &mbo, 1))
+			ring_produce(c, mbo);
+		atomic_set(&c->rx_bytes, 0);
 	}
+	c->ring_mode = true;
+	spin_unlock(&c->unlink);
+	spin_unlock_irqrestore(&c->ring_lock, flags);
+	mutex_unlock(&c->io_mutex);
+	return 0;
 
-	ret = to_copy - left;
+err_free:
+	ring_free(c);
 unlock:
 	mutex_unlock(&c->io_mutex);
 	return ret;
 }
 
+/* checks whether a message batch may be transferred, io_mutex held */
+static int msgs_check(struct aim_channel *c, enum most_channel_direction dir)
+{
+	if (!c->dev)
+		return -ENODEV;
+	if (c->cfg->direction != dir || ch_is_stream(c))
+		return -EINVAL;
+	if (ch_ring_busy(c))
+		return -EBUSY;
+	return 0;
+}
+
 /**
- * aim_read - implements the syscall to read from the device
+ * aim_recv_msgs - receives a batch of framed messages
  * @filp: file pointer
- * @buf: pointer to user buffer
- * @count: number of bytes to read
- * @offset: offset from where to start reading
+ * @arg: user space batch descriptor
+ *
+ * With timestamps enabled, each message is framed by the extended header
+ * carrying the completion time of its MBO.
+ *
+ * Returns the number of messages or error code.
  */
-static ssize_t
-aim_read(struct file *filp, char __user *buf, size_t count, loff_t *offset)
+static long aim_recv_msgs(struct file *filp, struct most_cdev_msgs __user *arg)
 {
-	size_t to_copy, not_copied, copied;
-	struct mbo *mbo;
 	struct aim_channel *c = filp->private_data;
+	struct most_cdev_msg_ts_hdr hdr = { };
+	struct most_cdev_msgs msgs;
+	char __user *buf;
+	struct mbo *mbo;
+	size_t hdr_len;
+	u32 frame;
+	u32 used = 0;
+	u32 num = 0;
+	long ret;
+
+	if (copy_from_user(&msgs, arg, sizeof(msgs)))
+		return -EFAULT;
+	buf = u64_to_user_ptr(msgs.buf);
 
 	mutex_lock(&c->io_mutex);
-	while (c->dev && !kfifo_peek(&c->fifo, &mbo)) {
-		mutex_unlock(&c->io_mutex);
-		if (filp->f_flags & O_NONBLOCK)
-			return -EAGAIN;
-		if (wait_event_interruptible(c->wq,
-					     (!kfifo_is_empty(&c->fifo) ||
-					      (!c->dev))))
-			return -ERESTARTSYS;
-		mutex_lock(&c->io_mutex);
-	}
+	ret = msgs_check(c, MOST_CH_RX);
+	if (ret)
+		goto unlock;
 
-	/* make sure we don't submit to gone devices */
-	if (unlikely(!c->dev)) {
-		mutex_unlock(&c->io_mutex);
-		return -ENODEV;
+	while (num < msgs.count) {
+		while (c->dev && (!kfifo_peek(&c->fifo, &mbo) ||
+				  (!num && !ch_rx_ready(c)))) {
+			if (num)
+				goto done;
+			mutex_unlock(&c->io_mutex);
+			if (filp->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			if (wait_event_interruptible(c->wq,
+						     (ch_rx_ready(c) ||
+						      ch_ring_busy(c) ||
+						      (!c->dev))))
+				return -ERESTARTSYS;
+			mutex_lock(&c->io_mutex);
+			if (ch_ring_busy(c)) {
+				ret = -EBUSY;
+				goto unlock;
+			}
+		}
+
+		if (unlikely(!c->dev)) {
+			ret = -ENODEV;
+			goto error;
+		}
+		/* the plain header is the prefix of the extended one */
+		hdr.length = mbo->processed_length - c->mbo_offs;
+		if (c->rx_tstamp) {
+			hdr.tstamp = ktime_to_ns(mbo->timestamp);
+			hdr_len = sizeof(hdr);
+			frame = MOST_CDEV_MSG_TS_SIZE(hdr.length);
+		} else {
+			hdr_len = sizeof(struct most_cdev_msg_hdr);
+			frame = MOST_CDEV_MSG_SIZE(hdr.length);
+		}
+		if (hdr_len + hdr.length > msgs.len - used) {
+			ret = -EMSGSIZE;
+			goto error;
+		}
+		if (copy_to_user(buf + used, &hdr, hdr_len) ||
+		    copy_to_user(buf + used + hdr_len,
+				 mbo->virt_address + c->mbo_offs, hdr.length)) {
+			ret = -EFAULT;
+			goto error;
+		}
+
+		rx_release(c, mbo);
+		c->mbo_offs = 0;
+		used = min_t(u32, used + frame, msgs.len);
+		num++;
 	}
+done:
+	mutex_unlock(&c->io_mutex);
+	msgs.len = used;
+	msgs.count = num;
+	if (copy_to_user(arg, &msgs, sizeof(msgs)))
+		return -EFAULT;
+	return num;
+
+error:
+	if (num)
+		goto done;
+unlock:
+	mutex_unlock(&c->io_mutex);
+	return ret;
+}
+
+/**
+ * aim_send_msgs - sends a batch of framed messages
+ * @filp: file pointer
+ * @arg: user space batch descriptor
+ *
+ * Every message is submitted in its own MBO.
+ *
+ * Returns the number of messages or error code.
+ */
+static long aim_send_msgs(struct file *filp, struct most_cdev_msgs __user *arg)
+{
+	struct aim_channel *c = filp->private_data;
+	struct most_cdev_msg_hdr hdr;
+	struct most_cdev_msgs msgs;
+	char __user *buf;
+	struct mbo *mbo = NULL;
+	u32 used = 0;
+	u32 num = 0;
+	long ret;
+
+	if (copy_from_user(&msgs, arg, sizeof(msgs)))
+		return -EFAULT;
+	buf = u64_to_user_ptr(msgs.buf);
 
-	to_copy = min_t(size_t,
-			count,
-			mbo->processed_length - c->mbo_offs);
+	mutex_lock(&c->io_mutex);
+	ret = msgs_check(c, MOST_CH_TX);
+	if (ret)
+		goto unlock;
 
-	not_copied = copy_to_user(buf,
-				  mbo->virt_address + c->mbo_offs,
-				  to_copy);
+	while (num < msgs.count && msgs.len - used >= sizeof(hdr)) {
+		if (copy_from_user(&hdr, buf + used, sizeof(hdr)))
+			ret = -EFAULT;
+		else if (!hdr.length || hdr.length > c->cfg->buffer_size ||
+			 sizeof(hdr) + hdr.length > msgs.len - used)
+			ret = -EINVAL;
+		if (ret)
+			goto error;
+
+		while (c->dev && !ch_get_mbo(c, &mbo)) {
+			if (num)
+				goto done;
+			mutex_unlock(&c->io_mutex);
+			if (filp->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			if (wait_event_interruptible(c->wq,
+						     ch_has_mbo(c) ||
+						     ch_ring_busy(c) ||
+						     !c->dev))
+				return -ERESTARTSYS;
+			mutex_lock(&c->io_mutex);
+			if (ch_ring_busy(c)) {
+				ret = -EBUSY;
+				goto unlock;
+			}
+		}
 
-	copied = to_copy - not_copied;
+		if (unlikely(!c->dev))
+			ret = -ENODEV;
+		else if (copy_from_user(mbo->virt_address,
+					buf + used + sizeof(hdr), hdr.length))
+			ret = -EFAULT;
+		if (ret)
+			goto error;
 
-	c->mbo_offs += copied;
-	if (c->mbo_offs >= mbo->processed_length) {
 		kfifo_skip(&c->fifo);
-		most_put_mbo(mbo);
-		c->mbo_offs = 0;
+		mbo->buffer_length = hdr.length;
+		most_submit_mbo(mbo);
+		used = min_t(u32, used + MOST_CDEV_MSG_SIZE(hdr.length),
+			     msgs.len);
+		num++;
 	}
+done:
+	mutex_unlock(&c->io_mutex);
+	msgs.len = used;
+	msgs.count = num;
+	if (copy_to_user(arg, &msgs, sizeof(msgs)))
+		return -EFAULT;
+	return num;
+
+error:
+	if (num)
+		goto done;
+unlock:
 	mutex_unlock(&c->io_mutex);
-	return copied;
+	return ret;
+}
+
+/**
+ * aim_set_wakeup - sets the Rx wakeup thresholds of an opened channel
+ * @c: pointer to channel object
+ * @arg: user space settings
+ */
+static long aim_set_wakeup(struct aim_channel *c,
+			   struct most_cdev_wakeup __user *arg)
+{
+	struct most_cdev_wakeup wk;
+	long ret = 0;
+
+	if (copy_from_user(&wk, arg, sizeof(wk)))
+		return -EFAULT;
+
+	mutex_lock(&c->io_mutex);
+	if (!c->dev) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+	/* thresholds the buffer pool cannot reach would never wake */
+	if (c->cfg->direction != MOST_CH_RX ||
+	    wk.min_buffers > c->cfg->num_buffers ||
+	    wk.min_bytes > c->cfg->num_buffers * c->cfg->buffer_size) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	WRITE_ONCE(c->wake_bytes, wk.min_bytes);
+	WRITE_ONCE(c->wake_buffers, max_t(u32, wk.min_buffers, 1));
+	WRITE_ONCE(c->wake_delay,
+		   ns_to_ktime((u64)wk.max_delay_us * NSEC_PER_USEC));
+	wake_up_interruptible(&c->wq);
+unlock:
+	mutex_unlock(&c->io_mutex);
+	return ret;
+}
+
+static long aim_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct aim_channel *c = filp->private_data;
+	struct most_cdev_ring_info info;
+	unsigned long flags;
+	int ret = 0;
+
+	switch (cmd) {
+	case MOST_CDEV_RING_INFO:
+		mutex_lock(&c->io_mutex);
+		if (!c->dev) {
+			mutex_unlock(&c->io_mutex);
+			return -ENODEV;
+		}
+		info.num_slots = c->cfg->num_buffers;
+		info.slot_size = ring_slot_size(c);
+		info.buffer_size = c->cfg->buffer_size;
+		info.ring_size = ring_ctrl_size(c);
+		mutex_unlock(&c->io_mutex);
+		if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+			return -EFAULT;
+		return 0;
+	case MOST_CDEV_RING_SYNC:
+		spin_lock_irqsave(&c->ring_lock, flags);
+		ret = c->ring_mode ? ring_sync(c) : -EINVAL;
+		spin_unlock_irqrestore(&c->ring_lock, flags);
+		return ret;
+	case MOST_CDEV_SET_WAKEUP:
+		return aim_set_wakeup(c, (void __user *)arg);
+	case MOST_CDEV_GET_WAKEUP: {
+		struct most_cdev_wakeup wk = {
+			.min_bytes = c->wake_bytes,
+			.min_buffers = c->wake_buffers,
+			.max_delay_us = ktime_to_us(c->wake_delay),
+		};
+
+		if (copy_to_user((void __user *)arg, &wk, sizeof(wk)))
+			return -EFAULT;
+		return 0;
+	}
+	case MOST_CDEV_SET_DIRECT_TX:
+		mutex_lock(&c->io_mutex);
+		if (!c->dev)
+			ret = -ENODEV;
+		else if (c->cfg->direction != MOST_CH_TX)
+			ret = -EINVAL;
+		else if (arg && !c->cfg->dma_sg)
+			ret = -EOPNOTSUPP;
+		else
+			c->direct_tx = arg;
+		mutex_unlock(&c->io_mutex);
+		return ret;
+	case MOST_CDEV_SET_EVENTFD:
+		mutex_lock(&c->io_mutex);
+		if (!c->dev)
+			ret = -ENODEV;
+		else
+			ret = ch_set_eventfd(c, (int)arg);
+		mutex_unlock(&c->io_mutex);
+		return ret;
+	case MOST_CDEV_SET_TIMESTAMPS:
+		mutex_lock(&c->io_mutex);
+		if (!c->dev)
+			ret = -ENODEV;
+		else if (c->cfg->direction != MOST_CH_RX)
+			ret = -EINVAL;
+		else
+			c->rx_tstamp = arg;
+		mutex_unlock(&c->io_mutex);
+		return ret;
+	case MOST_CDEV_GET_TIMESTAMP: {
+		struct mbo *mbo;
+		s64 ts = 0;
+
+		mutex_lock(&c->io_mutex);
+		if (!c->dev)
+			ret = -ENODEV;
+		else if (c->cfg->direction != MOST_CH_RX)
+			ret = -EINVAL;
+		else if (c->ring_mode || !kfifo_peek(&c->fifo, &mbo))
+			ret = -EAGAIN;
+		else
+			ts = ktime_to_ns(mbo->timestamp);
+		mutex_unlock(&c->io_mutex);
+		if (ret)
+			return ret;
+		if (copy_to_user((void __user *)arg, &ts, sizeof(ts)))
+			return -EFAULT;
+		return 0;
+	}
+	case MOST_CDEV_RECV_MSGS:
+		return aim_recv_msgs(filp, (void __user *)arg);
+	case MOST_CDEV_SEND_MSGS:
+		return aim_send_msgs(filp, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
 }
 
 static unsigned int aim_poll(struct file *filp, poll_table *wait)
@@ -294,8 +1621,11 @@ static unsigned int aim_poll(struct file *filp, poll_table *wait)
 
 	poll_wait(filp, &c->wq, wait);
 
+	if (c->ring_mode)
+		return ring_poll(c);
+
 	if (c->cfg->direction == MOST_CH_RX) {
-		if (!kfifo_is_empty(&c->fifo))
+		if (ch_rx_ready(c))
 			mask |= POLLIN | POLLRDNORM;
 	} else {
 		if (!kfifo_is_empty(&c->fifo) || ch_has_mbo(c))
@@ -309,11 +1639,16 @@ static unsigned int aim_poll(struct file *filp, poll_table *wait)
  */
 static const struct file_operations channel_fops = {
 	.owner = THIS_MODULE,
-	.read = aim_read,
-	.write = aim_write,
+	.read_iter = aim_read_iter,
+	.write_iter = aim_write_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
 	.open = aim_open,
 	.release = aim_close,
 	.poll = aim_poll,
+	.mmap = aim_mmap,
+	.unlocked_ioctl = aim_ioctl,
+	.compat_ioctl = aim_ioctl,
 };
 
 /**
@@ -326,6 +1661,7 @@ static const struct file_operations channel_fops = {
  */
 static int aim_disconnect_channel(struct most_interface *iface, int channel_id)
 {
+	struct aim_reader *r, *tmp;
 	struct aim_channel *c;
 
 	if (!iface) {
@@ -342,8 +1678,11 @@ static int aim_disconnect_channel(struct most_interface *iface, int channel_id)
 	c->dev = NULL;
 	spin_unlock(&c->unlink);
 	destroy_cdev(c);
-	if (c->access_ref) {
+	list_for_each_entry_safe(r, tmp, &c->readers, list)
+		reader_stop(r);
+	if (c->access_ref)
 		stop_channel(c);
+	if (c->access_ref || c->num_readers) {
 		wake_up_interruptible(&c->wq);
 		mutex_unlock(&c->io_mutex);
 	} else {
@@ -353,6 +1692,17 @@ static int aim_disconnect_channel(struct most_interface *iface, int channel_id)
 	return 0;
 }
 
+/* queues an MBO for a broadcast reader, called with unlink held */
+static void reader_deliver(struct aim_reader *r, struct mbo *mbo)
+{
+	struct mbo *old;
+
+	/* a reader lagging behind loses its oldest buffer */
+	if (kfifo_len(&r->fifo) >= r->lag && kfifo_out(&r->fifo, &old, 1))
+		ch_put_rx_mbo(r->c, old);
+	kfifo_in(&r->fifo, &mbo, 1);
+}
+
 /**
  * aim_rx_completion - completion handler for rx channels
  * @mbo: pointer to buffer object that has completed
@@ -363,6 +1713,10 @@ static int aim_disconnect_channel(struct most_interface *iface, int channel_id)
 static int aim_rx_completion(struct mbo *mbo)
 {
 	struct aim_channel *c;
+	struct aim_reader *r;
+	unsigned int holders;
+	unsigned long flags;
+	bool primary;
 
 	if (!mbo)
 		return -EINVAL;
@@ -371,18 +1725,44 @@ static int aim_rx_completion(struct mbo *mbo)
 	if (!c)
 		return -ENXIO;
 
+	spin_lock_irqsave(&c->ring_lock, flags);
+	if (c->ring_mode) {
+		ring_produce(c, mbo);
+		ring_sync(c);
+		rx_notify(c, rx_ready(c, c->ring_head - c->ring_tail,
+				      c->ring_bytes));
+		spin_unlock_irqrestore(&c->ring_lock, flags);
+		return 0;
+	}
+
 	spin_lock(&c->unlink);
-	if (!c->access_ref || !c->dev) {
+	primary = c->access_ref && c->dev;
+	holders = primary;
+	list_for_each_entry(r, &c->readers, list)
+		holders++;
+	if (!holders) {
 		spin_unlock(&c->unlink);
+		spin_unlock_irqrestore(&c->ring_lock, flags);
 		return -ENODEV;
 	}
-	kfifo_in(&c->fifo, &mbo, 1);
+	if (c->mbo_refs)
+		atomic_set(&c->mbo_refs[mbo->index], holders);
+
+	list_for_each_entry(r, &c->readers, list)
+		reader_deliver(r, mbo);
+	if (primary) {
+		kfifo_in(&c->fifo, &mbo, 1);
+		atomic_add(mbo->processed_length, &c->rx_bytes);
+		rx_notify(c, ch_rx_ready(c));
+	} else {
+		wake_up_interruptible(&c->wq);
+	}
 	spin_unlock(&c->unlink);
+	spin_unlock_irqrestore(&c->ring_lock, flags);
 #ifdef DEBUG_MESG
 	if (kfifo_is_full(&c->fifo))
 		pr_info("WARN: Fifo is full\n");
 #endif
-	wake_up_interruptible(&c->wq);
 	return 0;
 }
 
@@ -409,7 +1789,16 @@ static int aim_tx_completion(struct most_interface *iface, int channel_id)
 	c = get_channel(iface, channel_id);
 	if (!c)
 		return -ENXIO;
-	wake_up_interruptible(&c->wq);
+	if (c->ring_mode) {
+		unsigned long flags;
+
+		spin_lock_irqsave(&c->ring_lock, flags);
+		if (c->ring_mode)
+			ring_reclaim_tx(c);
+		spin_unlock_irqrestore(&c->ring_lock, flags);
+	}
+	ch_signal(c, 1);
+	wake_up(&c->wq);
 	return 0;
 }
 
@@ -461,6 +1850,11 @@ static int aim_probe(struct most_interface *iface, int channel_id,
 	c->channel_id = channel_id;
 	c->access_ref = 0;
 	spin_lock_init(&c->unlink);
+	spin_lock_init(&c->ring_lock);
+	spin_lock_init(&c->ev_lock);
+	INIT_LIST_HEAD(&c->readers);
+	hrtimer_init(&c->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	c->wake_timer.function = wake_timer_fn;
 	INIT_KFIFO(c->fifo);
 	retval = kfifo_alloc(&c->fifo, cfg->num_buffers, GFP_KERNEL);
 	if (retval) {
@@ -0,0 +1,172 @@
+/*
+ * most_cdev.h - user space interface of the character device AIM
+ *
+ * Copyright (C) 2013-2015 Microchip Technology Germany II GmbH & Co. KG
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This file is licensed under GPLv2.
+ */
+
+#ifndef __MOST_CDEV_H__
+#define __MOST_CDEV_H__
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/**
+ * struct most_cdev_ring_info - layout of the ring mapping
+ * @num_slots: number of buffers (slots) of the channel
+ * @slot_size: distance between two buffers in the mapping
+ * @buffer_size: usable size of a buffer
+ * @ring_size: size of the control area
+ *
+ * The control area is mapped at file offset 0 and is ring_size bytes long.
+ * The slots are mapped separately at file offset ring_size, that mapping is
+ * num_slots * slot_size bytes long and slot n starts at n * slot_size.
+ */
+struct most_cdev_ring_info {
+	__u32 num_slots;
+	__u32 slot_size;
+	__u32 buffer_size;
+	__u32 ring_size;
+};
+
+/**
+ * struct most_cdev_ring_desc - ring entry
+ * @slot: index of the buffer
+ * @length: number of valid bytes in the buffer
+ */
+struct most_cdev_ring_desc {
+	__u32 slot;
+	__u32 length;
+};
+
+/**
+ * struct most_cdev_ring - control area shared with user space
+ * @head: number of entries produced
+ * @tail: number of entries consumed
+ * @desc: entries, entry i lives in desc[i % num_slots]
+ *
+ * Both counters run freely and wrap at 2^32.
+ *
+ * Rx: the driver fills desc[head % num_slots] and advances head.  The
+ * application processes the slot the entry refers to and advances tail,
+ * which hands the buffer back to the driver.
+ *
+ * Tx: the application writes to slot head % num_slots, sets the length of
+ * the entry and advances head.  The driver advances tail as soon as the
+ * buffer has been transmitted, so slots up to tail + num_slots may be
+ * written.
+ *
+ * Updates of the peer are picked up by poll() and MOST_CDEV_RING_SYNC.
+ */
+struct most_cdev_ring {
+	__u32 head;
+	__u32 tail;
+	struct most_cdev_ring_desc desc[0];
+};
+
+/**
+ * struct most_cdev_msg_hdr - header of a framed message
+ * @length: number of payload bytes following the header
+ *
+ * The next header starts at the following 4 byte boundary, see
+ * MOST_CDEV_MSG_SIZE().
+ */
+struct most_cdev_msg_hdr {
+	__u32 length;
+};
+
+#define MOST_CDEV_MSG_SIZE(len) \
+	((sizeof(struct most_cdev_msg_hdr) + (len) + 3) & ~3UL)
+
+/**
+ * struct most_cdev_msg_ts_hdr - header of a framed message with timestamp
+ * @length: number of payload bytes following the header
+ * @reserved: always zero
+ * @tstamp: CLOCK_MONOTONIC time in ns at which the HDM completed the message
+ *
+ * Used by MOST_CDEV_RECV_MSGS once MOST_CDEV_SET_TIMESTAMPS is enabled.  The
+ * next header starts at the following 8 byte boundary, see
+ * MOST_CDEV_MSG_TS_SIZE().
+ */
+struct most_cdev_msg_ts_hdr {
+	__u32 length;
+	__u32 reserved;
+	__s64 tstamp;
+};
+
+#define MOST_CDEV_MSG_TS_SIZE(len) \
+	((sizeof(struct most_cdev_msg_ts_hdr) + (len) + 7) & ~7UL)
+
+/**
+ * struct most_cdev_msgs - batch of framed messages
+ * @buf: user space address of the message buffer
+ * @len: size of the buffer, number of bytes used on return
+ * @count: maximum number of messages, number transferred on return
+ *
+ * Used by MOST_CDEV_RECV_MSGS and MOST_CDEV_SEND_MSGS on control and async
+ * channels.  Each message travels in its own MBO.  Both ioctls block until
+ * the first message can be transferred unless O_NONBLOCK is set, and
+ * return the number of messages.
+ */
+struct most_cdev_msgs {
+	__u64 buf;
+	__u32 len;
+	__u32 count;
+};
+
+/**
+ * struct most_cdev_wakeup - Rx wakeup thresholds
+ * @min_bytes: bytes to queue before the reader is woken
+ * @min_buffers: buffers to queue before the reader is woken
+ * @max_delay_us: time after which queued data wakes the reader anyway,
+ *	0 waits for the thresholds only
+ *
+ * Applies to read(), poll() and the ring mode of Rx channels until the
+ * device is closed.  A reader is woken when both thresholds are reached.
+ */
+struct most_cdev_wakeup {
+	__u32 min_bytes;
+	__u32 min_buffers;
+	__u32 max_delay_us;
+};
+
+#define MOST_CDEV_IOC_MAGIC	0xB5
+
+#define MOST_CDEV_RING_INFO	_IOR(MOST_CDEV_IOC_MAGIC, 0, \
+				     struct most_cdev_ring_info)
+#define MOST_CDEV_RING_SYNC	_IO(MOST_CDEV_IOC_MAGIC, 1)
+#define MOST_CDEV_RECV_MSGS	_IOWR(MOST_CDEV_IOC_MAGIC, 2, \
+				      struct most_cdev_msgs)
+#define MOST_CDEV_SEND_MSGS	_IOWR(MOST_CDEV_IOC_MAGIC, 3, \
+				      struct most_cdev_msgs)
+#define MOST_CDEV_SET_WAKEUP	_IOW(MOST_CDEV_IOC_MAGIC, 4, \
+				     struct most_cdev_wakeup)
+#define MOST_CDEV_GET_WAKEUP	_IOR(MOST_CDEV_IOC_MAGIC, 5, \
+				     struct most_cdev_wakeup)
+/*
+ * Enables (arg != 0) or disables direct Tx: full buffers within one iovec
+ * of a write to a streaming channel are sent from the pinned user pages
+ * instead of being copied, the rest is copied as usual.  The call returns
+ * when the data has been sent.  Fails with EOPNOTSUPP if the HDM cannot
+ * transmit from user pages, which for USB is every channel that needs
+ * padding, i.e. all but isoc channels with packets_per_xact 0xFF.
+ */
+#define MOST_CDEV_SET_DIRECT_TX	_IO(MOST_CDEV_IOC_MAGIC, 6)
+/* Enables (arg != 0) timestamped frames for MOST_CDEV_RECV_MSGS */
+#define MOST_CDEV_SET_TIMESTAMPS _IO(MOST_CDEV_IOC_MAGIC, 7)
+/* Completion time of the Rx message the next read() returns, in ns */
+#define MOST_CDEV_GET_TIMESTAMP	_IOR(MOST_CDEV_IOC_MAGIC, 8, __s64)
+/*
+ * Registers the eventfd passed as arg, a negative arg removes it.  The
+ * eventfd counts the Rx buffers that became available and the Tx buffers
+ * that were freed, which saves an event loop the poll() round trip.
+ */
+#define MOST_CDEV_SET_EVENTFD	_IO(MOST_CDEV_IOC_MAGIC, 9)
+
+#endif /* __MOST_CDEV_H__ */
@@ -15,6 +15,7 @@
 
 #include <linux/module.h>
 #include <linux/netdevice.h>
+#include <linux/ethtool.h>
 #include <linux/etherdevice.h>
 #include <linux/slab.h>
 #include <linux/init.h>
@@ -22,6 +23,12 @@
 #include <linux/wait.h>
 #include <linux/kobject.h>
 #include <linux/kref.h>
+#include <linux/crc32.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/scatterlist.h>
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <linux/filter.h>
 #include "mostcore.h"
 
 #define MEP_HDR_LEN 8
@@ -58,28 +65,129 @@
 	 EXTRACT_BIT_SET(PMS_FIFONO, (buf)[3]) == PMS_FIFONO_MDP && \
 	 EXTRACT_BIT_SET(PMS_TELID, (buf)[14]) == PMS_TELID_UNSEGM_MAMAC)
 
+#define MAX_NET_QUEUES 4
+#define MAX_RING_PENDING 1024
+
+/**
+ * struct nd_tx_slot - frame in flight in the Tx MBO of the same index
+ * @len: bytes reported to BQL
+ * @skb: frame transmitted straight from the skb, freed once the HDM has
+ *	 sent it
+ * @sgt: table handed to the HDM in mbo->sgt
+ * @sg: header followed by the data of the skb
+ * @hdr: MEP or MDP header of the frame
+ */
+struct nd_tx_slot {
+	unsigned int len;
+	struct sk_buff *skb;
+	struct sg_table sgt;
+	struct scatterlist sg[MAX_SKB_FRAGS + 2];
+	u8 hdr[MDP_HDR_LEN];
+};
+
+/**
+ * struct net_dev_channel - async channel serving one queue of the device
+ * @ch_id: channel ID
+ * @cfg: configuration of the channel
+ * @nd: network device context the channel belongs to
+ * @lock: protects @queue and @on, or @slots
+ * @napi: Rx: NAPI instance of the queue
+ * @queue: Rx: received MBOs waiting for the NAPI poll
+ * @on: Rx: MBOs are accepted for @queue
+ * @xdp_redirect: Rx: the NAPI poll has redirected frames
+ * @slots: Tx: frames in flight, indexed by mbo->index
+ * @inflight: Tx: number of frames in flight
+ * @pending: Tx: MBOs held back by xmit_more
+ */
 struct net_dev_channel {
-	bool linked;
 	int ch_id;
+	struct most_channel_config *cfg;
+	struct net_dev_context *nd;
+	spinlock_t lock;
+
+	struct napi_struct napi;
+	struct list_head queue;
+	bool on;
+	bool xdp_redirect;
+
+	struct nd_tx_slot *slots;
+	atomic_t inflight;
+	struct list_head pending;
 };
 
+/**
+ * struct nd_pcpu_stats - per CPU counters of a network device
+ * @rx_no_skb: drops for lack of an skb, reported by ethtool -S like the
+ *	other drop causes below
+ * @rx_wrong_type: counted in HDM completion context with this_cpu_inc(),
+ *	outside of @syncp
+ * @syncp: protects the 64 bit counters, which are updated in softirq
+ *	context only
+ */
+struct nd_pcpu_stats {
+	u64 rx_packets;
+	u64 rx_bytes;
+	u64 rx_dropped;
+	u64 tx_packets;
+	u64 tx_bytes;
+	u64 tx_dropped;
+	u64 tx_fifo_errors;
+	u64 rx_no_skb;
+	u64 tx_too_small;
+	u64 tx_queue_stops;
+	unsigned long rx_wrong_type;
+	struct u64_stats_sync syncp;
+};
+
+#define nd_stats_inc(nd, field) nd_stats_add(nd, field, 1)
+#define nd_stats_add(nd, field, val) do {				\
+	struct nd_pcpu_stats *__s = this_cpu_ptr((nd)->stats);		\
+									\
+	u64_stats_update_begin(&__s->syncp);				\
+	__s->field += (val);						\
+	u64_stats_update_end(&__s->syncp);				\
+} while (0)
+
 struct net_dev_context {
 	struct most_interface *iface;
 	bool is_mamac;
 	struct net_device *dev;
-	struct net_dev_channel rx;
-	struct net_dev_channel tx;
+	struct net_dev_channel rx[MAX_NET_QUEUES];
+	struct net_dev_channel tx[MAX_NET_QUEUES];
+	/*
+	 * The channels change under RTNL while the device is down, and under
+	 * ch_lock against the completion paths of channels still running
+	 * for another AIM.
+	 */
+	spinlock_t ch_lock;
+	int num_rx;
+	int num_tx;
+	bool registered;
+	u16 mep_hash[4];
+	struct bpf_prog __rcu *xdp_prog;
 	struct list_head list;
 	struct kref kref;
+	struct nd_pcpu_stats __percpu *stats;
+};
+
+static const char nd_stat_names[][ETH_GSTRING_LEN] = {
+	"rx_no_skb",
+	"rx_wrong_type",
+	"tx_too_small",
+	"tx_queue_stops",
 };
 
 static struct list_head net_devices = LIST_HEAD_INIT(net_devices);
 static struct spinlock list_lock;
 static struct most_aim aim;
 
-static int skb_to_mamac(const struct sk_buff *skb, struct mbo *mbo)
+static unsigned int rx_copybreak = 256;
+module_param(rx_copybreak, uint, 0644);
+MODULE_PARM_DESC(rx_copybreak, "Frames from this size on are passed up in the receive buffer instead of a copy, if the HDM allows (default: 256)");
+
+/* skb_to_mamac - writes the MDP header of a frame to buff */
+static int skb_to_mamac(const struct sk_buff *skb, struct mbo *mbo, u8 *buff)
 {
-	u8 *buff = mbo->virt_address;
 	const u8 broadcast[] = { 0x03, 0xFF };
 	const u8 *dest_addr = skb->data + 4;
 	const u8 *eth_type = skb->data + 12;
@@ -123,22 +231,12 @@ static int skb_to_mamac(const struct sk_buff *skb, struct mbo *mbo)
 	*buff++ = PMS_TELID_UNSEGM_MAMAC << 4 | HB(payload_len);
 	*buff++ = LB(payload_len);
 
-	memcpy(buff, skb->data + ETH_HLEN, payload_len);
 	mbo->buffer_length = mdp_len;
 	return 0;
 }
 
-static int skb_to_mep(const struct sk_buff *skb, struct mbo *mbo)
+static void mep_hdr(u8 *buff, unsigned int mep_len)
 {
-	u8 *buff = mbo->virt_address;
-	unsigned int mep_len = skb->len + MEP_HDR_LEN;
-
-	if (mbo->buffer_length < mep_len) {
-		pr_err("drop: too small buffer! (%d for %d)\n",
-		       mbo->buffer_length, mep_len);
-		return -EINVAL;
-	}
-
 	*buff++ = HB(mep_len - 2);
 	*buff++ = LB(mep_len - 2);
 
@@ -148,8 +246,20 @@ static int skb_to_mep(const struct sk_buff *skb, struct mbo *mbo)
 	*buff++ = 0;
 	*buff++ = 0;
 	*buff++ = 0;
+}
+
+/* skb_to_mep - writes the MEP header of a frame to buff */
+static int skb_to_mep(const struct sk_buff *skb, struct mbo *mbo, u8 *buff)
+{
+	unsigned int mep_len = skb->len + MEP_HDR_LEN;
 
-	memcpy(buff, skb->data, skb->len);
+	if (mbo->buffer_length < mep_len) {
+		pr_err("drop: too small buffer! (%d for %d)\n",
+		       mbo->buffer_length, mep_len);
+		return -EINVAL;
+	}
+
+	mep_hdr(buff, mep_len);
 	mbo->buffer_length = mep_len;
 	return 0;
 }
@@ -175,37 +285,265 @@ static int most_nd_set_mac_address(struct net_device *dev, void *p)
 	return 0;
 }
 
+/* sets the bit of the MEP hash table that @addr selects */
+static void nd_mep_hash_add(u16 *hash, const u8 *addr)
+{
+	u32 bit = ether_crc(ETH_ALEN, addr) >> 26;
+
+	hash[bit >> 4] |= 1 << (bit & 15);
+}
+
+/* checks whether the MEP hash table lets a frame to @addr pass */
+static bool nd_mep_hash_match(struct net_dev_context *nd, const u8 *addr)
+{
+	u32 bit = ether_crc(ETH_ALEN, addr) >> 26;
+
+	return READ_ONCE(nd->mep_hash[bit >> 4]) & (1 << (bit & 15));
+}
+
+/**
+ * most_nd_set_rx_mode - program the multicast filter of the INIC
+ * @dev: network device
+ *
+ * The MEP hash table is handed to the HDM, but the INIC only applies it
+ * if its filter mode (dci/mep_filter) says so.  The NAPI poll therefore
+ * applies the table as well and drops multicast frames it does not
+ * select.  The table is opened completely in promiscuous and allmulti
+ * mode.
+ */
+static void most_nd_set_rx_mode(struct net_device *dev)
+{
+	struct net_dev_context *nd = netdev_priv(dev);
+	struct netdev_hw_addr *ha;
+	u16 hash[4] = { 0 };
+	int i;
+
+	if (dev->flags & (IFF_PROMISC | IFF_ALLMULTI)) {
+		memset(hash, 0xff, sizeof(hash));
+	} else {
+		/* broadcast may be subject to the hash as well */
+		nd_mep_hash_add(hash, dev->broadcast);
+		netdev_for_each_mc_addr(ha, dev)
+			nd_mep_hash_add(hash, ha->addr);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(hash); i++)
+		WRITE_ONCE(nd->mep_hash[i], hash[i]);
+	if (nd->iface->set_mep_hash)
+		nd->iface->set_mep_hash(nd->iface, hash);
+}
+
+static void most_nd_get_stats64(struct net_device *dev,
+				struct rtnl_link_stats64 *stats)
+{
+	struct net_dev_context *nd = netdev_priv(dev);
+	u64 rx_packets, rx_bytes, rx_dropped, tx_packets, tx_bytes;
+	u64 tx_dropped, tx_fifo_errors;
+	unsigned int start;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct nd_pcpu_stats *s = per_cpu_ptr(nd->stats, cpu);
+
+		do {
+			start = u64_stats_fetch_begin_irq(&s->syncp);
+			rx_packets = s->rx_packets;
+			rx_bytes = s->rx_bytes;
+			rx_dropped = s->rx_dropped;
+			tx_packets = s->tx_packets;
+			tx_bytes = s->tx_bytes;
+			tx_dropped = s->tx_dropped;
+			tx_fifo_errors = s->tx_fifo_errors;
+		} while (u64_stats_fetch_retry_irq(&s->syncp, start));
+
+		stats->rx_packets += rx_packets;
+		stats->rx_bytes += rx_bytes;
+		stats->rx_dropped += rx_dropped;
+		stats->tx_packets += tx_packets;
+		stats->tx_bytes += tx_bytes;
+		stats->tx_dropped += tx_dropped;
+		stats->tx_fifo_errors += tx_fifo_errors;
+	}
+	stats->tx_errors = stats->tx_fifo_errors;
+}
+
 static void on_netinfo(struct most_interface *iface,
 		       unsigned char link_stat, unsigned char *mac_addr);
 
+/* returns the index of the channel with the given ID or -1 */
+static int nd_find_ch(const struct net_dev_channel *ch, int num, int ch_id)
+{
+	int i;
+
+	for (i = 0; i < num; i++)
+		if (ch[i].ch_id == ch_id)
+			return i;
+	return -1;
+}
+
+/*
+ * nd_rx_flush - disables the NAPI poll of an Rx channel and returns the
+ * queued MBOs, which have to be back in the core before it is stopped
+ */
+static void nd_rx_flush(struct net_dev_channel *ch)
+{
+	struct mbo *mbo, *tmp;
+	unsigned long flags;
+	LIST_HEAD(queue);
+
+	spin_lock_irqsave(&ch->lock, flags);
+	ch->on = false;
+	spin_unlock_irqrestore(&ch->lock, flags);
+
+	napi_disable(&ch->napi);
+
+	spin_lock_irqsave(&ch->lock, flags);
+	list_splice_init(&ch->queue, &queue);
+	spin_unlock_irqrestore(&ch->lock, flags);
+
+	list_for_each_entry_safe(mbo, tmp, &queue, list) {
+		list_del(&mbo->list);
+		most_put_mbo(mbo);
+	}
+}
+
+/**
+ * nd_tx_gather - describes a frame for an HDM that gathers it itself
+ * @ch: Tx channel
+ * @slot: slot of the MBO the frame travels in
+ * @skb: frame
+ * @hdr_len: length of the header in slot->hdr
+ * @offs: start of the data within the skb
+ *
+ * Returns false if the frame has more pieces than the HDM accepts, so
+ * that it is copied instead.
+ */
+static bool nd_tx_gather(struct net_dev_channel *ch, struct nd_tx_slot *slot,
+			 struct sk_buff *skb, unsigned int hdr_len,
+			 unsigned int offs)
+{
+	unsigned int max_ents = DIV_ROUND_UP(ch->cfg->buffer_size,
+					     PAGE_SIZE) + 1;
+	int nsg;
+
+	if (skb_shinfo(skb)->nr_frags + 2 > max_ents)
+		return false;
+
+	sg_init_table(slot->sg, ARRAY_SIZE(slot->sg));
+	sg_set_buf(slot->sg, slot->hdr, hdr_len);
+	nsg = skb_to_sgvec(skb, slot->sg + 1, offs, skb->len - offs);
+	if (nsg < 0 || nsg + 1 > max_ents)
+		return false;
+	sg_mark_end(slot->sg + nsg);
+	slot->sgt.sgl = slot->sg;
+	slot->sgt.nents = nsg + 1;
+	slot->sgt.orig_nents = nsg + 1;
+	return true;
+}
+
+/* releases the slots of a Tx channel once it has been stopped */
+static void nd_tx_free(struct net_dev_channel *ch)
+{
+	struct nd_tx_slot *slots;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&ch->lock, flags);
+	slots = ch->slots;
+	ch->slots = NULL;
+	spin_unlock_irqrestore(&ch->lock, flags);
+
+	for (i = 0; slots && i < ch->cfg->num_buffers; i++)
+		dev_kfree_skb_any(slots[i].skb);
+	kfree(slots);
+}
+
+/* hands the MBOs held back by xmit_more to the HDM */
+static void nd_tx_flush(struct net_dev_channel *ch)
+{
+	struct mbo *mbo, *tmp;
+
+	list_for_each_entry_safe(mbo, tmp, &ch->pending, list) {
+		list_del(&mbo->list);
+		most_submit_mbo(mbo);
+	}
+}
+
+/* stops the first num_rx Rx and num_tx Tx channels of a device */
+static void nd_stop_channels(struct net_dev_context *nd, int num_rx,
+			     int num_tx)
+{
+	int i;
+
+	for (i = 0; i < num_tx; i++)
+		nd_tx_flush(&nd->tx[i]);
+	for (i = 0; i < num_rx; i++) {
+		nd_rx_flush(&nd->rx[i]);
+		most_stop_channel(nd->iface, nd->rx[i].ch_id, &aim);
+	}
+	for (i = 0; i < num_tx; i++) {
+		most_stop_channel(nd->iface, nd->tx[i].ch_id, &aim);
+		nd_tx_free(&nd->tx[i]);
+	}
+}
+
 static int most_nd_open(struct net_device *dev)
 {
 	struct net_dev_context *nd = netdev_priv(dev);
+	struct net_dev_channel *ch;
+	int num_rx, num_tx;
+	int ret = -EBUSY;
 
 	netdev_info(dev, "open net device\n");
 
-	BUG_ON(!nd->tx.linked || !nd->rx.linked);
-
-	if (most_start_channel(nd->iface, nd->rx.ch_id, &aim)) {
-		netdev_err(dev, "most_start_channel() failed\n");
-		return -EBUSY;
+	/* a device that lost all channels of one direction stays down */
+	if (!nd->num_tx || !nd->num_rx)
+		return -ENODEV;
+
+	for (num_rx = 0; num_rx < nd->num_rx; num_rx++) {
+		ch = nd->rx + num_rx;
+		ch->on = true;
+		napi_enable(&ch->napi);
+		if (most_start_channel(nd->iface, ch->ch_id, &aim)) {
+			netdev_err(dev, "most_start_channel() failed\n");
+			nd_rx_flush(ch);
+			goto err;
+		}
 	}
 
-	if (most_start_channel(nd->iface, nd->tx.ch_id, &aim)) {
-		netdev_err(dev, "most_start_channel() failed\n");
-		most_stop_channel(nd->iface, nd->rx.ch_id, &aim);
-		return -EBUSY;
+	for (num_tx = 0; num_tx < nd->num_tx; num_tx++) {
+		ch = nd->tx + num_tx;
+		if (most_start_channel(nd->iface, ch->ch_id, &aim)) {
+			netdev_err(dev, "most_start_channel() failed\n");
+			goto err;
+		}
+		ch->slots = kcalloc(ch->cfg->num_buffers, sizeof(*ch->slots),
+				    GFP_KERNEL);
+		if (!ch->slots) {
+			most_stop_channel(nd->iface, ch->ch_id, &aim);
+			ret = -ENOMEM;
+			goto err;
+		}
+		atomic_set(&ch->inflight, 0);
+		netdev_tx_reset_queue(netdev_get_tx_queue(dev, num_tx));
 	}
 
+	netif_set_real_num_tx_queues(dev, nd->num_tx);
+	netif_set_real_num_rx_queues(dev, nd->num_rx);
 	netif_carrier_off(dev);
 	if (is_valid_ether_addr(dev->dev_addr))
 		netif_dormant_off(dev);
 	else
 		netif_dormant_on(dev);
-	netif_wake_queue(dev);
+	netif_tx_wake_all_queues(dev);
 	if (nd->iface->request_netinfo)
-		nd->iface->request_netinfo(nd->iface, nd->tx.ch_id, on_netinfo);
+		nd->iface->request_netinfo(nd->iface, nd->tx[0].ch_id,
+					   on_netinfo);
 	return 0;
+
+err:
+	nd_stop_channels(nd, num_rx, num_tx);
+	return ret;
 }
 
 static int most_nd_stop(struct net_device *dev)
@@ -214,60 +552,500 @@ static int most_nd_stop(struct net_device *dev)
 
 	netdev_info(dev, "stop net device\n");
 
-	netif_stop_queue(dev);
+	netif_tx_stop_all_queues(dev);
 	if (nd->iface->request_netinfo)
-		nd->iface->request_netinfo(nd->iface, nd->tx.ch_id, NULL);
-	most_stop_channel(nd->iface, nd->rx.ch_id, &aim);
-	most_stop_channel(nd->iface, nd->tx.ch_id, &aim);
+		nd->iface->request_netinfo(nd->iface, nd->tx[0].ch_id, NULL);
+	nd_stop_channels(nd, nd->num_rx, nd->num_tx);
 
 	return 0;
 }
 
+/*
+ * nd_tx_wake_level - number of frames in flight below which a stopped
+ * queue is woken again, so that it does not flap on every completion
+ */
+static inline unsigned int nd_tx_wake_level(struct net_dev_channel *ch)
+{
+	return ch->cfg->num_buffers - ch->cfg->num_buffers / 4;
+}
+
+/*
+ * most_nd_start_xmit - sends a frame on the Tx channel of its queue, the
+ * stack spreads the flows over the queues by their hash
+ */
 static netdev_tx_t most_nd_start_xmit(struct sk_buff *skb,
 				      struct net_device *dev)
 {
 	struct net_dev_context *nd = netdev_priv(dev);
+	u16 q = skb_get_queue_mapping(skb);
+	struct net_dev_channel *ch = nd->tx + q;
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, q);
+	unsigned int hdr_len, offs;
+	bool more = skb->xmit_more;
+	struct nd_tx_slot *slot;
+	bool gathered = false;
+	unsigned long flags;
 	struct mbo *mbo;
 	int ret;
 
-	mbo = most_get_mbo(nd->iface, nd->tx.ch_id, &aim);
+	mbo = most_get_mbo(nd->iface, ch->ch_id, &aim);
 
 	if (!mbo) {
-		netif_stop_queue(dev);
-		dev->stats.tx_fifo_errors++;
+		netif_tx_stop_queue(txq);
+		nd_tx_flush(ch);
+		nd_stats_inc(nd, tx_queue_stops);
+		nd_stats_inc(nd, tx_fifo_errors);
 		return NETDEV_TX_BUSY;
 	}
 
+	slot = ch->slots + mbo->index;
 	if (nd->is_mamac)
-		ret = skb_to_mamac(skb, mbo);
+		ret = skb_to_mamac(skb, mbo, slot->hdr);
 	else
-		ret = skb_to_mep(skb, mbo);
+		ret = skb_to_mep(skb, mbo, slot->hdr);
 
 	if (ret) {
 		most_put_mbo(mbo);
-		dev->stats.tx_dropped++;
+		nd_stats_inc(nd, tx_too_small);
+		nd_stats_inc(nd, tx_dropped);
 		kfree_skb(skb);
+		if (!more)
+			nd_tx_flush(ch);
 		return NETDEV_TX_OK;
 	}
 
-	most_submit_mbo(mbo);
-	dev->stats.tx_packets++;
-	dev->stats.tx_bytes += skb->len;
-	kfree_skb(skb);
+	hdr_len = nd->is_mamac ? MDP_HDR_LEN : MEP_HDR_LEN;
+	offs = nd->is_mamac ? ETH_HLEN : 0;
+	slot->len = skb->len;
+	if (ch->cfg->dma_sg && nd_tx_gather(ch, slot, skb, hdr_len, offs)) {
+		spin_lock_irqsave(&ch->lock, flags);
+		mbo->sgt = &slot->sgt;
+		slot->skb = skb;
+		spin_unlock_irqrestore(&ch->lock, flags);
+		gathered = true;
+	} else {
+		/* the header goes first, the data behind it */
+		memcpy(mbo->virt_address, slot->hdr, hdr_len);
+		skb_copy_bits(skb, offs, mbo->virt_address + hdr_len,
+			      skb->len - offs);
+	}
+
+	nd_stats_inc(nd, tx_packets);
+	nd_stats_add(nd, tx_bytes, slot->len);
+	if (!gathered)
+		kfree_skb(skb);
+	netdev_tx_sent_queue(txq, slot->len);
+	if (atomic_inc_return(&ch->inflight) >= ch->cfg->num_buffers) {
+		netif_tx_stop_queue(txq);
+		nd_stats_inc(nd, tx_queue_stops);
+	}
+
+	/* hold the MBO back while the stack has more frames for us */
+	list_add_tail(&mbo->list, &ch->pending);
+	if (!more || netif_xmit_stopped(txq))
+		nd_tx_flush(ch);
 	return NETDEV_TX_OK;
 }
 
+/*
+ * nd_xdp_tx - sends a frame back out for XDP_TX on the Tx queue of the
+ * current CPU, called by the NAPI poll
+ */
+static bool nd_xdp_tx(struct net_dev_context *nd, const void *data, u32 len)
+{
+	int cpu = smp_processor_id();
+	int q = cpu % nd->num_tx;
+	struct net_dev_channel *ch = nd->tx + q;
+	struct netdev_queue *txq = netdev_get_tx_queue(nd->dev, q);
+	struct mbo *mbo;
+	bool ret = false;
+
+	__netif_tx_lock(txq, cpu);
+	mbo = most_get_mbo(nd->iface, ch->ch_id, &aim);
+	if (!mbo)
+		goto unlock;
+	if (mbo->buffer_length < len + MEP_HDR_LEN) {
+		most_put_mbo(mbo);
+		goto unlock;
+	}
+
+	mep_hdr(mbo->virt_address, len + MEP_HDR_LEN);
+	memcpy(mbo->virt_address + MEP_HDR_LEN, data, len);
+	mbo->buffer_length = len + MEP_HDR_LEN;
+	ch->slots[mbo->index].len = len;
+	netdev_tx_sent_queue(txq, len);
+	if (atomic_inc_return(&ch->inflight) >= ch->cfg->num_buffers) {
+		netif_tx_stop_queue(txq);
+		nd_stats_inc(nd, tx_queue_stops);
+	}
+	nd_tx_flush(ch);
+	most_submit_mbo(mbo);
+	ret = true;
+unlock:
+	__netif_tx_unlock(txq);
+	return ret;
+}
+
+/**
+ * nd_run_xdp - runs the XDP program on a received MEP frame
+ * @ch: Rx channel
+ * @prog: XDP program
+ * @mbo: MBO holding the frame
+ * @start: offset of the Ethernet frame in the buffer, updated for XDP_PASS
+ * @end: end of the frame in the buffer, updated for XDP_PASS
+ *
+ * The program sees the frame in place, behind the MEP header.  Frames are
+ * redirected in their buffer page, which requires page buffers.
+ *
+ * Returns true if the frame has been consumed and the MBO returned.
+ */
+static bool nd_run_xdp(struct net_dev_channel *ch, struct bpf_prog *prog,
+		       struct mbo *mbo, u32 *start, u32 *end)
+{
+	struct net_dev_context *nd = ch->nd;
+	struct net_device *dev = nd->dev;
+	u8 *buf = mbo->virt_address;
+	struct xdp_buff xdp;
+	struct page *page;
+	u32 act;
+
+	xdp.data_hard_start = buf;
+	xdp.data = buf + *start;
+	xdp.data_end = buf + *end;
+	act = bpf_prog_run_xdp(prog, &xdp);
+
+	switch (act) {
+	case XDP_PASS:
+		*start = (u8 *)xdp.data - buf;
+		*end = (u8 *)xdp.data_end - buf;
+		return false;
+	case XDP_TX:
+		if (!nd_xdp_tx(nd, xdp.data, xdp.data_end - xdp.data))
+			goto err;
+		break;
+	case XDP_REDIRECT:
+		page = most_detach_mbo_page(mbo, GFP_ATOMIC);
+		if (!page)
+			goto err;
+		if (xdp_do_redirect(dev, &xdp, prog)) {
+			put_page(page);
+			goto err;
+		}
+		ch->xdp_redirect = true;
+		break;
+	default:
+		bpf_warn_invalid_xdp_action(act);
+		/* fall through */
+	case XDP_ABORTED:
+err:
+		trace_xdp_exception(dev, prog, act);
+		nd_stats_inc(nd, rx_dropped);
+		/* fall through */
+	case XDP_DROP:
+		break;
+	}
+	most_put_mbo(mbo);
+	return true;
+}
+
+/**
+ * nd_rx_frame - passes a received MBO up the stack, called by the NAPI poll
+ * @ch: Rx channel
+ * @mbo: MBO holding the frame, returned to the core afterwards
+ *
+ * Large frames on channels with page buffers are not copied: the buffer
+ * page is detached from the MBO and attached to the skb as fragment, which
+ * starts behind the MEP/MDP header.  Only the Ethernet header goes to the
+ * linear part.
+ */
+static void nd_rx_frame(struct net_dev_channel *ch, struct mbo *mbo)
+{
+	const u32 zero = 0;
+	struct net_dev_context *nd = ch->nd;
+	char *buf = mbo->virt_address;
+	u32 len = mbo->processed_length;
+	u32 hdr_len = nd->is_mamac ? MDP_HDR_LEN : MEP_HDR_LEN;
+	struct net_device *dev = nd->dev;
+	struct page *page = NULL;
+	struct bpf_prog *prog;
+	struct sk_buff *skb;
+	unsigned int skb_len;
+	u32 copy_len;
+
+	/* the INIC may not filter multicast frames itself */
+	if (!nd->is_mamac && len - hdr_len >= ETH_ALEN &&
+	    is_multicast_ether_addr((u8 *)buf + hdr_len) &&
+	    !nd_mep_hash_match(nd, (u8 *)buf + hdr_len))
+		goto out;
+
+	/* MAMAC frames have no Ethernet header to run XDP on */
+	prog = rcu_dereference(nd->xdp_prog);
+	if (prog && !nd->is_mamac && nd_run_xdp(ch, prog, mbo, &hdr_len, &len))
+		return;
+
+	copy_len = len - hdr_len;
+	if (copy_len > ETH_HLEN && copy_len >= rx_copybreak) {
+		page = most_detach_mbo_page(mbo, GFP_ATOMIC);
+		if (page)
+			copy_len = nd->is_mamac ? 0 : ETH_HLEN;
+	}
+
+	if (nd->is_mamac)
+		skb = napi_alloc_skb(&ch->napi, copy_len + 2 * ETH_ALEN + 2);
+	else
+		skb = napi_alloc_skb(&ch->napi, copy_len);
+
+	if (!skb) {
+		nd_stats_inc(nd, rx_no_skb);
+		nd_stats_inc(nd, rx_dropped);
+		pr_err_once("drop packet: no memory for skb\n");
+		if (page)
+			put_page(page);
+		goto out;
+	}
+
+	skb->dev = dev;
+
+	if (nd->is_mamac) {
+		/* dest */
+		ether_addr_copy(skb_put(skb, ETH_ALEN), dev->dev_addr);
+
+		/* src */
+		memcpy(skb_put(skb, 4), &zero, 4);
+		memcpy(skb_put(skb, 2), buf + 5, 2);
+
+		/* eth type */
+		memcpy(skb_put(skb, 2), buf + 10, 2);
+	}
+
+	memcpy(skb_put(skb, copy_len), buf + hdr_len, copy_len);
+	if (page)
+		skb_add_rx_frag(skb, 0, page, hdr_len + copy_len,
+				len - hdr_len - copy_len,
+				PAGE_SIZE << compound_order(page));
+	skb->protocol = eth_type_trans(skb, dev);
+	skb_record_rx_queue(skb, ch - nd->rx);
+	skb_len = skb->len;
+	if (napi_gro_receive(&ch->napi, skb) != GRO_DROP) {
+		nd_stats_inc(nd, rx_packets);
+		nd_stats_add(nd, rx_bytes, skb_len);
+	} else {
+		nd_stats_inc(nd, rx_dropped);
+	}
+
+out:
+	most_put_mbo(mbo);
+}
+
+static int most_nd_poll(struct napi_struct *napi, int budget)
+{
+	struct net_dev_channel *ch = container_of(napi, struct net_dev_channel,
+						  napi);
+	unsigned long flags;
+	struct mbo *mbo;
+	int work = 0;
+
+	rcu_read_lock();
+	while (work < budget) {
+		spin_lock_irqsave(&ch->lock, flags);
+		mbo = list_first_entry_or_null(&ch->queue, struct mbo, list);
+		if (mbo)
+			list_del(&mbo->list);
+		spin_unlock_irqrestore(&ch->lock, flags);
+		if (!mbo)
+			break;
+		nd_rx_frame(ch, mbo);
+		work++;
+	}
+	rcu_read_unlock();
+
+	if (ch->xdp_redirect) {
+		ch->xdp_redirect = false;
+		xdp_do_flush_map();
+	}
+
+	if (work < budget && napi_complete_done(napi, work)) {
+		/* catch MBOs queued while the poll was still scheduled */
+		spin_lock_irqsave(&ch->lock, flags);
+		if (!list_empty(&ch->queue))
+			napi_schedule(napi);
+		spin_unlock_irqrestore(&ch->lock, flags);
+	}
+	return work;
+}
+
+static int most_nd_xdp_setup(struct net_device *dev, struct bpf_prog *prog)
+{
+	struct net_dev_context *nd = netdev_priv(dev);
+	struct bpf_prog *old;
+
+	if (prog && nd->is_mamac)
+		return -EOPNOTSUPP;
+
+	old = rtnl_dereference(nd->xdp_prog);
+	rcu_assign_pointer(nd->xdp_prog, prog);
+	if (old)
+		bpf_prog_put(old);
+	return 0;
+}
+
+static int most_nd_xdp(struct net_device *dev, struct netdev_xdp *xdp)
+{
+	struct net_dev_context *nd = netdev_priv(dev);
+	struct bpf_prog *prog;
+
+	switch (xdp->command) {
+	case XDP_SETUP_PROG:
+		return most_nd_xdp_setup(dev, xdp->prog);
+	case XDP_QUERY_PROG:
+		prog = rtnl_dereference(nd->xdp_prog);
+		xdp->prog_attached = !!prog;
+		xdp->prog_id = prog ? prog->aux->id : 0;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
 static const struct net_device_ops most_nd_ops = {
 	.ndo_open = most_nd_open,
 	.ndo_stop = most_nd_stop,
 	.ndo_start_xmit = most_nd_start_xmit,
 	.ndo_set_mac_address = most_nd_set_mac_address,
+	.ndo_set_rx_mode = most_nd_set_rx_mode,
+	.ndo_get_stats64 = most_nd_get_stats64,
+	.ndo_xdp = most_nd_xdp,
+};
+
+static void most_nd_get_ringparam(struct net_device *dev,
+				  struct ethtool_ringparam *ring)
+{
+	struct net_dev_context *nd = netdev_priv(dev);
+
+	ring->rx_max_pending = MAX_RING_PENDING;
+	ring->tx_max_pending = MAX_RING_PENDING;
+	ring->rx_pending = nd->num_rx ? nd->rx[0].cfg->num_buffers : 0;
+	ring->tx_pending = nd->num_tx ? nd->tx[0].cfg->num_buffers : 0;
+}
+
+/*
+ * nd_set_num_buffers - sets the number of buffers of all channels of a
+ * device, either all of them or, if one is refused, none
+ */
+static int nd_set_num_buffers(struct net_dev_context *nd, u16 rx_num,
+			      u16 tx_num)
+{
+	u16 old_rx[MAX_NET_QUEUES], old_tx[MAX_NET_QUEUES];
+	int ret = 0;
+	int i, j;
+
+	for (i = 0; i < nd->num_rx; i++)
+		old_rx[i] = nd->rx[i].cfg->num_buffers;
+	for (j = 0; j < nd->num_tx; j++)
+		old_tx[j] = nd->tx[j].cfg->num_buffers;
+
+	for (i = 0; i < nd->num_rx && !ret; i++)
+		ret = most_set_num_buffers(nd->iface, nd->rx[i].ch_id, rx_num);
+	for (j = 0; j < nd->num_tx && !ret; j++)
+		ret = most_set_num_buffers(nd->iface, nd->tx[j].ch_id, tx_num);
+	if (!ret)
+		return 0;
+
+	/* the refused channel is among these, but it is unchanged anyway */
+	while (j--)
+		most_set_num_buffers(nd->iface, nd->tx[j].ch_id, old_tx[j]);
+	while (i--)
+		most_set_num_buffers(nd->iface, nd->rx[i].ch_id, old_rx[i]);
+	return ret;
+}
+
+/*
+ * most_nd_set_ringparam - sets the number of buffers of all channels,
+ * a running device is closed and opened again to reallocate them.
+ * Channels still started by another AIM keep their buffers and fail
+ * the request.
+ */
+static int most_nd_set_ringparam(struct net_device *dev,
+				 struct ethtool_ringparam *ring)
+{
+	struct net_dev_context *nd = netdev_priv(dev);
+	bool running = netif_running(dev);
+	int ret;
+	int err;
+
+	if (ring->rx_mini_pending || ring->rx_jumbo_pending ||
+	    !ring->rx_pending || !ring->tx_pending ||
+	    ring->rx_pending > MAX_RING_PENDING ||
+	    ring->tx_pending > MAX_RING_PENDING)
+		return -EINVAL;
+
+	if (running)
+		dev_close(dev);
+	ret = nd_set_num_buffers(nd, ring->rx_pending, ring->tx_pending);
+	if (!running)
+		return ret;
+
+	err = dev_open(dev);
+	if (err)
+		netdev_err(dev, "restart failed\n");
+	return ret ? ret : err;
+}
+
+static int most_nd_get_sset_count(struct net_device *dev, int sset)
+{
+	if (sset != ETH_SS_STATS)
+		return -EOPNOTSUPP;
+	return ARRAY_SIZE(nd_stat_names);
+}
+
+static void most_nd_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	if (sset == ETH_SS_STATS)
+		memcpy(data, nd_stat_names, sizeof(nd_stat_names));
+}
+
+static void most_nd_get_ethtool_stats(struct net_device *dev,
+				      struct ethtool_stats *stats, u64 *data)
+{
+	struct net_dev_context *nd = netdev_priv(dev);
+	u64 no_skb, too_small, queue_stops;
+	unsigned int start;
+	int cpu;
+
+	memset(data, 0, ARRAY_SIZE(nd_stat_names) * sizeof(*data));
+	for_each_possible_cpu(cpu) {
+		struct nd_pcpu_stats *s = per_cpu_ptr(nd->stats, cpu);
+
+		do {
+			start = u64_stats_fetch_begin_irq(&s->syncp);
+			no_skb = s->rx_no_skb;
+			too_small = s->tx_too_small;
+			queue_stops = s->tx_queue_stops;
+		} while (u64_stats_fetch_retry_irq(&s->syncp, start));
+
+		data[0] += no_skb;
+		data[1] += s->rx_wrong_type;
+		data[2] += too_small;
+		data[3] += queue_stops;
+	}
+}
+
+static const struct ethtool_ops most_nd_ethtool_ops = {
+	.get_link = ethtool_op_get_link,
+	.get_ringparam = most_nd_get_ringparam,
+	.set_ringparam = most_nd_set_ringparam,
+	.get_sset_count = most_nd_get_sset_count,
+	.get_strings = most_nd_get_strings,
+	.get_ethtool_stats = most_nd_get_ethtool_stats,
 };
 
 static void most_nd_setup(struct net_device *dev)
 {
 	ether_setup(dev);
 	dev->netdev_ops = &most_nd_ops;
+	dev->ethtool_ops = &most_nd_ethtool_ops;
+	dev->hw_features |= NETIF_F_SG;
+	dev->features |= NETIF_F_SG;
 }
 
 static void release_nd(struct kref *kref)
@@ -286,8 +1064,15 @@ static inline void put_net_dev_context(struct net_dev_context *nd)
 	spin_lock_irqsave(&list_lock, flags);
 	released = kref_put(&nd->kref, release_nd);
 	spin_unlock_irqrestore(&list_lock, flags);
-	if (released)
+	if (released) {
+		struct bpf_prog *prog = rcu_dereference_protected(nd->xdp_prog,
+								  true);
+
+		if (prog)
+			bpf_prog_put(prog);
+		free_percpu(nd->stats);
 		free_netdev(nd->dev);
+	}
 }
 
 static struct net_dev_context *get_net_dev_context(
@@ -308,6 +1093,33 @@ static struct net_dev_context *get_net_dev_context(
 	return NULL;
 }
 
+static void nd_init_channels(struct net_dev_context *nd)
+{
+	struct net_dev_channel *ch;
+	int i;
+
+	for (i = 0; i < MAX_NET_QUEUES; i++) {
+		ch = nd->rx + i;
+		ch->nd = nd;
+		spin_lock_init(&ch->lock);
+		INIT_LIST_HEAD(&ch->queue);
+		netif_napi_add(nd->dev, &ch->napi, most_nd_poll,
+			       NAPI_POLL_WEIGHT);
+
+		ch = nd->tx + i;
+		ch->nd = nd;
+		spin_lock_init(&ch->lock);
+		INIT_LIST_HEAD(&ch->pending);
+	}
+}
+
+/*
+ * aim_probe_channel - links an async channel to the network device of its
+ * interface.  Up to MAX_NET_QUEUES channels per direction are served as
+ * separate queues, the device is registered with the first pair and
+ * unregistered with the last channel.  Channels cannot be linked while
+ * the device is up.
+ */
 static int aim_probe_channel(struct most_interface *iface, int channel_idx,
 			     struct most_channel_config *ccfg,
 			     struct kobject *parent, char *name)
@@ -315,6 +1127,8 @@ static int aim_probe_channel(struct most_interface *iface, int channel_idx,
 	struct net_dev_context *nd;
 	struct net_dev_channel *ch;
 	unsigned long flags;
+	int ret = -EINVAL;
+	int *num;
 
 	if (!iface)
 		return -EINVAL;
@@ -324,13 +1138,22 @@ static int aim_probe_channel(struct most_interface *iface, int channel_idx,
 
 	nd = get_net_dev_context(iface);
 	if (!nd) {
+		struct nd_pcpu_stats __percpu *stats;
 		struct net_device *dev;
 
-		dev = alloc_netdev(sizeof(struct net_dev_context), "meth%d",
-				   NET_NAME_UNKNOWN, most_nd_setup);
+		dev = alloc_netdev_mqs(sizeof(struct net_dev_context),
+				       "meth%d", NET_NAME_UNKNOWN,
+				       most_nd_setup, MAX_NET_QUEUES,
+				       MAX_NET_QUEUES);
 		if (!dev)
 			return -ENOMEM;
 
+		stats = netdev_alloc_pcpu_stats(struct nd_pcpu_stats);
+		if (!stats) {
+			free_netdev(dev);
+			return -ENOMEM;
+		}
+
 		/*
 		 * The network device for the given iface may be added with use
 		 * of the other channel just after the get_net_dev_context
@@ -341,6 +1164,7 @@ static int aim_probe_channel(struct most_interface *iface, int channel_idx,
 			if (nd->iface == iface) {
 				kref_get(&nd->kref);
 				spin_unlock_irqrestore(&list_lock, flags);
+				free_percpu(stats);
 				free_netdev(dev);
 				goto ok;
 			}
@@ -350,30 +1174,58 @@ static int aim_probe_channel(struct most_interface *iface, int channel_idx,
 		kref_init(&nd->kref);
 		nd->iface = iface;
 		nd->dev = dev;
+		nd->stats = stats;
+		spin_lock_init(&nd->ch_lock);
+		nd_init_channels(nd);
 		list_add(&nd->list, &net_devices);
 		spin_unlock_irqrestore(&list_lock, flags);
 	}
 
 ok:
-	ch = ccfg->direction == MOST_CH_TX ? &nd->tx : &nd->rx;
-	if (ch->linked) {
-		pr_err("only one channel per instance & direction allowed\n");
-		goto err;
+	if (ccfg->direction == MOST_CH_TX) {
+		ch = nd->tx;
+		num = &nd->num_tx;
+	} else {
+		ch = nd->rx;
+		num = &nd->num_rx;
+	}
+
+	rtnl_lock();
+	/* the channels of a running device are started and NAPI enabled */
+	if (netif_running(nd->dev)) {
+		netdev_err(nd->dev, "cannot link channels while up\n");
+		ret = -EBUSY;
+		goto unlock;
+	}
+	if (*num == MAX_NET_QUEUES) {
+		pr_err("only %d channels per instance & direction allowed\n",
+		       MAX_NET_QUEUES);
+		goto unlock;
 	}
 
-	ch->ch_id = channel_idx;
-	ch->linked = true;
-	if (nd->tx.linked && nd->rx.linked && register_netdev(nd->dev)) {
-		pr_err("register_netdev() failed\n");
-		ch->linked = false;
-		goto err;
+	spin_lock_irqsave(&nd->ch_lock, flags);
+	ch[*num].ch_id = channel_idx;
+	ch[*num].cfg = ccfg;
+	(*num)++;
+	spin_unlock_irqrestore(&nd->ch_lock, flags);
+	if (!nd->registered && nd->num_tx && nd->num_rx) {
+		if (register_netdevice(nd->dev)) {
+			pr_err("register_netdev() failed\n");
+			spin_lock_irqsave(&nd->ch_lock, flags);
+			(*num)--;
+			spin_unlock_irqrestore(&nd->ch_lock, flags);
+			goto unlock;
+		}
+		nd->registered = true;
 	}
+	rtnl_unlock();
 
 	return 0;
 
-err:
+unlock:
+	rtnl_unlock();
 	put_net_dev_context(nd);
-	return -EINVAL;
+	return ret;
 }
 
 static int aim_disconnect_channel(struct most_interface *iface,
@@ -381,124 +1233,186 @@ static int aim_disconnect_channel(struct most_interface *iface,
 {
 	struct net_dev_context *nd;
 	struct net_dev_channel *ch;
+	unsigned long flags;
 	int ret = -EINVAL;
+	int *num;
+	int i;
 
 	nd = get_net_dev_context(iface);
 	if (!nd)
 		return -EINVAL;
 
-	if (nd->rx.linked && channel_idx == nd->rx.ch_id)
-		ch = &nd->rx;
-	else if (nd->tx.linked && channel_idx == nd->tx.ch_id)
-		ch = &nd->tx;
-	else
-		goto put_nd;
+	rtnl_lock();
+	i = nd_find_ch(nd->rx, nd->num_rx, channel_idx);
+	if (i >= 0) {
+		ch = nd->rx;
+		num = &nd->num_rx;
+	} else {
+		i = nd_find_ch(nd->tx, nd->num_tx, channel_idx);
+		if (i < 0)
+			goto unlock;
+		ch = nd->tx;
+		num = &nd->num_tx;
+	}
 
 	/*
 	 * do not call most_stop_channel() here, because channels are
-	 * going to be closed in ndo_stop() after unregister_netdev()
+	 * going to be closed in ndo_stop() by dev_close()
 	 */
-	if (nd->rx.linked && nd->tx.linked)
-		unregister_netdev(nd->dev);
+	dev_close(nd->dev);
 
-	ch->linked = false;
-	put_net_dev_context(nd);
+	/*
+	 * The remaining channels move up.  With the device down, the NAPI
+	 * contexts are disabled and the queues, slots and pending lists of
+	 * all channels are empty, so only the channel itself moves.
+	 */
+	spin_lock_irqsave(&nd->ch_lock, flags);
+	(*num)--;
+	ch[i].ch_id = ch[*num].ch_id;
+	ch[i].cfg = ch[*num].cfg;
+	ch[*num].cfg = NULL;
+	spin_unlock_irqrestore(&nd->ch_lock, flags);
+
+	/*
+	 * The device stays registered as long as any of its channels is
+	 * linked, so that linking another channel never registers it again.
+	 * The last one takes it down for good, before it is freed.
+	 */
+	if (nd->registered && !nd->num_rx && !nd->num_tx) {
+		unregister_netdevice(nd->dev);
+		nd->registered = false;
+	}
 	ret = 0;
 
-put_nd:
+unlock:
+	/* the device has to be unregistered for good before it is freed */
+	rtnl_unlock();
+	if (!ret)
+		put_net_dev_context(nd);
 	put_net_dev_context(nd);
 	return ret;
 }
 
+/*
+ * aim_tx_done - completes a transmitted frame, called by the core before
+ * the MBO is recycled
+ */
+static void aim_tx_done(struct mbo *mbo)
+{
+	struct net_dev_context *nd;
+	struct net_dev_channel *ch;
+	struct netdev_queue *txq;
+	struct sk_buff *skb = NULL;
+	unsigned int len = 0;
+	unsigned long flags;
+	int q;
+
+	nd = get_net_dev_context(mbo->ifp);
+	if (!nd)
+		return;
+
+	spin_lock_irqsave(&nd->ch_lock, flags);
+	q = nd_find_ch(nd->tx, nd->num_tx, mbo->hdm_channel_id);
+	if (q < 0)
+		goto unlock;
+
+	ch = nd->tx + q;
+	spin_lock(&ch->lock);
+	if (ch->slots) {
+		skb = ch->slots[mbo->index].skb;
+		ch->slots[mbo->index].skb = NULL;
+		len = ch->slots[mbo->index].len;
+	}
+	spin_unlock(&ch->lock);
+	if (skb)
+		dev_consume_skb_any(skb);
+
+	txq = netdev_get_tx_queue(nd->dev, q);
+	netdev_tx_completed_queue(txq, 1, len);
+	if (atomic_dec_return(&ch->inflight) < nd_tx_wake_level(ch) &&
+	    netif_tx_queue_stopped(txq) && netif_running(nd->dev))
+		netif_tx_wake_queue(txq);
+
+unlock:
+	spin_unlock_irqrestore(&nd->ch_lock, flags);
+	put_net_dev_context(nd);
+}
+
+/*
+ * aim_resume_tx_channel - wakes a stopped queue once the core has MBOs
+ * again.  aim_tx_done() only covers frames of this AIM, whereas MBOs also
+ * come from a growing lazy pool or from another AIM sharing the channel.
+ */
 static int aim_resume_tx_channel(struct most_interface *iface,
 				 int channel_idx)
 {
 	struct net_dev_context *nd;
+	struct netdev_queue *txq;
+	unsigned long flags;
+	int q;
 
 	nd = get_net_dev_context(iface);
 	if (!nd)
 		return 0;
 
-	if (nd->tx.ch_id == channel_idx)
-		netif_wake_queue(nd->dev);
+	spin_lock_irqsave(&nd->ch_lock, flags);
+	q = nd_find_ch(nd->tx, nd->num_tx, channel_idx);
+	if (q < 0)
+		goto unlock;
+
+	txq = netdev_get_tx_queue(nd->dev, q);
+	if (atomic_read(&nd->tx[q].inflight) < nd_tx_wake_level(nd->tx + q) &&
+	    netif_tx_queue_stopped(txq) && netif_running(nd->dev))
+		netif_tx_wake_queue(txq);
 
+unlock:
+	spin_unlock_irqrestore(&nd->ch_lock, flags);
 	put_net_dev_context(nd);
 	return 0;
 }
 
+/*
+ * aim_rx_data - queues a received frame for the NAPI poll of its channel
+ *
+ * Runs in HDM completion context and only checks the packet type, so
+ * that frames of other types are still offered to the other AIM.
+ */
 static int aim_rx_data(struct mbo *mbo)
 {
-	const u32 zero = 0;
 	struct net_dev_context *nd;
+	struct net_dev_channel *ch;
 	char *buf = mbo->virt_address;
 	u32 len = mbo->processed_length;
-	struct sk_buff *skb;
-	struct net_device *dev;
-	unsigned int skb_len;
+	unsigned long flags;
 	int ret = -EIO;
+	int q;
 
 	nd = get_net_dev_context(mbo->ifp);
 	if (!nd)
 		return -EIO;
 
-	if (nd->rx.ch_id != mbo->hdm_channel_id)
-		goto put_nd;
-
-	dev = nd->dev;
-
-	if (nd->is_mamac) {
-		if (!PMS_IS_MAMAC(buf, len))
-			goto put_nd;
-
-		skb = dev_alloc_skb(len - MDP_HDR_LEN + 2 * ETH_ALEN + 2);
-	} else {
-		if (!PMS_IS_MEP(buf, len))
-			goto put_nd;
+	spin_lock_irqsave(&nd->ch_lock, flags);
+	q = nd_find_ch(nd->rx, nd->num_rx, mbo->hdm_channel_id);
+	if (q < 0)
+		goto unlock;
 
-		skb = dev_alloc_skb(len - MEP_HDR_LEN);
+	if (nd->is_mamac ? !PMS_IS_MAMAC(buf, len) : !PMS_IS_MEP(buf, len)) {
+		this_cpu_inc(nd->stats->rx_wrong_type);
+		goto unlock;
 	}
 
-	ret = 0;
-	if (!skb) {
-		dev->stats.rx_dropped++;
-		pr_err_once("drop packet: no memory for skb\n");
-		goto out;
+	ch = nd->rx + q;
+	spin_lock(&ch->lock);
+	if (ch->on) {
+		list_add_tail(&mbo->list, &ch->queue);
+		ret = 0;
 	}
+	spin_unlock(&ch->lock);
+	if (!ret)
+		napi_schedule(&ch->napi);
 
-	skb->dev = dev;
-
-	if (nd->is_mamac) {
-		/* dest */
-		ether_addr_copy(skb_put(skb, ETH_ALEN), dev->dev_addr);
-
-		/* src */
-		memcpy(skb_put(skb, 4), &zero, 4);
-		memcpy(skb_put(skb, 2), buf + 5, 2);
-
-		/* eth type */
-		memcpy(skb_put(skb, 2), buf + 10, 2);
-
-		buf += MDP_HDR_LEN;
-		len -= MDP_HDR_LEN;
-	} else {
-		buf += MEP_HDR_LEN;
-		len -= MEP_HDR_LEN;
-	}
-
-	memcpy(skb_put(skb, len), buf, len);
-	skb->protocol = eth_type_trans(skb, dev);
-	skb_len = skb->len;
-	if (netif_rx(skb) == NET_RX_SUCCESS) {
-		dev->stats.rx_packets++;
-		dev->stats.rx_bytes += skb_len;
-	} else {
-		dev->stats.rx_dropped++;
-	}
-
-out:
-	most_put_mbo(mbo);
-
-put_nd:
+unlock:
+	spin_unlock_irqrestore(&nd->ch_lock, flags);
 	put_net_dev_context(nd);
 	return ret;
 }
@@ -507,6 +1421,7 @@ static struct most_aim aim = {
 	.name = "networking",
 	.probe_channel = aim_probe_channel,
 	.disconnect_channel = aim_disconnect_channel,
+	.tx_done = aim_tx_done,
 	.tx_completion = aim_resume_tx_channel,
 	.rx_completion = aim_rx_data,
 };
@@ -27,6 +27,7 @@
 #include <linux/workqueue.h>
 #include <linux/sysfs.h>
 #include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
 #include <linux/etherdevice.h>
 #include <linux/uaccess.h>
 #include "mostcore.h"
@@ -105,7 +106,16 @@ struct clear_hold_work {
  * @busy_urbs: list of anchored items
  * @io_mutex: synchronize I/O with disconnect
  * @link_stat_timer: timer for link status reports
- * @poll_work_obj: work for polling link status
+ * @poll_work_obj: work delivering the network information
+ * @ni_urb: control URB reading the NI state
+ * @ni_setup: setup packet of ni_urb
+ * @ni_buf: transfer buffer of ni_urb
+ * @ni_busy: ni_urb is in flight
+ * @link_stat: last NI state read
+ * @netinfo_valid: link_stat has been reported
+ * @mep_lock: protects mep_hash
+ * @mep_hash: MEP multicast hash table to be written by mep_work
+ * @mep_work: work writing the MEP hash table to the INIC
  */
 struct most_dev {
 	struct kobject *parent;
@@ -125,6 +135,15 @@ struct most_dev {
 	struct mutex io_mutex;
 	struct timer_list link_stat_timer;
 	struct work_struct poll_work_obj;
+	struct urb *ni_urb;
+	struct usb_ctrlrequest *ni_setup;
+	__le16 *ni_buf;
+	atomic_t ni_busy;
+	u16 link_stat;
+	bool netinfo_valid;
+	spinlock_t mep_lock; /* protects mep_hash */
+	u16 mep_hash[4];
+	struct work_struct mep_work;
 	void (*on_netinfo)(struct most_interface *, unsigned char,
 			   unsigned char *);
 };
@@ -134,6 +153,12 @@ struct most_dev {
 
 static void wq_clear_halt(struct work_struct *wq_obj);
 static void wq_netinfo(struct work_struct *wq_obj);
+static void wq_mep_hash(struct work_struct *wq_obj);
+static void hdm_ni_state_completion(struct urb *urb);
+
+static unsigned int link_poll_ms = 500;
+module_param(link_poll_ms, uint, 0644);
+MODULE_PARM_DESC(link_poll_ms, "Interval of the NI state poll in ms (default: 500)");
 
 /**
  * drci_rd_reg - read a DCI register
@@ -262,6 +287,7 @@ static int hdm_poison_channel(struct most_interface *iface, int channel)
 
 	if (mdev->conf[channel].data_type == MOST_CH_ASYNC) {
 		del_timer_sync(&mdev->link_stat_timer);
+		usb_kill_urb(mdev->ni_urb);
 		cancel_work_sync(&mdev->poll_work_obj);
 	}
 	mutex_unlock(&mdev->io_mutex);
@@ -593,7 +619,7 @@ static int hdm_enqueue(struct most_interface *iface, int channel,
 		usb_fill_bulk_urb(urb, mdev->usb_device,
 				  usb_sndbulkpipe(mdev->usb_device,
 						  mdev->ep_address[channel]),
-				  virt_address,
+				  mbo->sgt ? NULL : virt_address,
 				  length,
 				  hdm_write_completion,
 				  mbo);
@@ -608,7 +634,13 @@ static int hdm_enqueue(struct most_interface *iface, int channel,
 				  hdm_read_completion,
 				  mbo);
 	}
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	if (mbo->sgt) {
+		/* user pages, mapped by the USB core */
+		urb->sg = mbo->sgt->sgl;
+		urb->num_sgs = mbo->sgt->nents;
+	} else if (!conf->page_buffers) {
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
 
 	usb_anchor_urb(urb, &mdev->busy_urbs[channel]);
 
@@ -670,7 +702,21 @@ static int hdm_configure_channel(struct most_interface *iface, int channel,
 	if (conf->data_type != MOST_CH_SYNC &&
 	    !(conf->data_type == MOST_CH_ISOC &&
 	      conf->packets_per_xact != 0xFF)) {
+		struct usb_bus *bus = mdev->usb_device->bus;
+
 		mdev->padding_active[channel] = false;
+		/*
+		 * Unpadded Tx data may come straight from user pages.  The
+		 * only streaming channels this covers are isoc channels with
+		 * packets_per_xact 0xFF, padded ones keep copying.
+		 */
+		conf->dma_sg = conf->direction == MOST_CH_TX &&
+			       bus->no_sg_constraint &&
+			       bus->sg_tablesize >=
+			       DIV_ROUND_UP(conf->buffer_size, PAGE_SIZE) + 1;
+		/* received packets may be passed on in their own pages */
+		conf->page_buffers = conf->direction == MOST_CH_RX &&
+				     conf->data_type == MOST_CH_ASYNC;
 		/*
 		 * Since the NIC's padding mode is not going to be
 		 * used, we can skip the frame size calculations and
@@ -717,8 +763,8 @@ exit:
  * @channel: channel ID
  *
  * This is used as trigger to set up the link status timer that
- * polls for the NI state of the INIC every 2 seconds.
- *
+ * polls for the NI state of the INIC every link_poll_ms milliseconds.
+ * The current state is reported right away, later on only changes are.
  */
 static void hdm_request_netinfo(struct most_interface *iface, int channel,
 				void (*on_netinfo)(struct most_interface *,
@@ -733,58 +779,83 @@ static void hdm_request_netinfo(struct most_interface *iface, int channel,
 	if (!on_netinfo)
 		return;
 
-	mdev->link_stat_timer.expires = jiffies + HZ;
-	mod_timer(&mdev->link_stat_timer, mdev->link_stat_timer.expires);
+	mdev->netinfo_valid = false;
+	mod_timer(&mdev->link_stat_timer, jiffies);
 }
 
 /**
- * link_stat_timer_handler - schedule work obtaining mac address and link status
+ * link_stat_timer_handler - poll the NI state
  * @data: pointer to USB device instance
  *
- * The handler runs in interrupt context. That's why we need to defer the
- * tasks to a work queue.
+ * The handler runs in interrupt context.  It submits the asynchronous
+ * read of the NI state unless the previous one is still in flight.
  */
 static void link_stat_timer_handler(unsigned long data)
 {
 	struct most_dev *mdev = (struct most_dev *)data;
 
-	schedule_work(&mdev->poll_work_obj);
-	mdev->link_stat_timer.expires = jiffies + (2 * HZ);
-	add_timer(&mdev->link_stat_timer);
+	if (!atomic_xchg(&mdev->ni_busy, 1) &&
+	    usb_submit_urb(mdev->ni_urb, GFP_ATOMIC))
+		atomic_set(&mdev->ni_busy, 0);
+	mod_timer(&mdev->link_stat_timer,
+		  jiffies + msecs_to_jiffies(link_poll_ms));
+}
+
+/**
+ * hdm_ni_state_completion - completion routine of the NI state read
+ * @urb: the control URB
+ *
+ * Schedules the delivery of the network information if the NI state has
+ * changed since the last report.
+ *
+ * Context: interrupt!
+ */
+static void hdm_ni_state_completion(struct urb *urb)
+{
+	struct most_dev *mdev = urb->context;
+	u16 link;
+
+	if (!urb->status && urb->actual_length == sizeof(*mdev->ni_buf)) {
+		link = le16_to_cpup(mdev->ni_buf);
+		if (!mdev->netinfo_valid || link != mdev->link_stat) {
+			mdev->link_stat = link;
+			mdev->netinfo_valid = true;
+			schedule_work(&mdev->poll_work_obj);
+		}
+	}
+	atomic_set(&mdev->ni_busy, 0);
 }
 
 /**
  * wq_netinfo - work queue function to deliver latest networking information
  * @wq_obj: object that holds data for our deferred work to do
  *
- * This retrieves the network interface status of the USB INIC
+ * This reports a changed NI state together with the MAC address, which is
+ * read again as it may have been assigned along with the new state.  The
+ * report is repeated with each poll as long as no MAC address is assigned.
  */
 static void wq_netinfo(struct work_struct *wq_obj)
 {
 	struct most_dev *mdev = to_mdev_from_work(wq_obj);
 	struct usb_device *usb_device = mdev->usb_device;
 	struct device *dev = &usb_device->dev;
-	u16 hi, mi, lo, link;
+	u16 link = READ_ONCE(mdev->link_stat);
+	u16 hi, mi, lo;
 	u8 hw_addr[6];
 
 	if (drci_rd_reg(usb_device, DRCI_REG_HW_ADDR_HI, &hi) < 0) {
 		dev_err(dev, "Vendor request 'hw_addr_hi' failed\n");
-		return;
+		goto retry;
 	}
 
 	if (drci_rd_reg(usb_device, DRCI_REG_HW_ADDR_MI, &mi) < 0) {
 		dev_err(dev, "Vendor request 'hw_addr_mid' failed\n");
-		return;
+		goto retry;
 	}
 
 	if (drci_rd_reg(usb_device, DRCI_REG_HW_ADDR_LO, &lo) < 0) {
 		dev_err(dev, "Vendor request 'hw_addr_low' failed\n");
-		return;
-	}
-
-	if (drci_rd_reg(usb_device, DRCI_REG_NI_STATE, &link) < 0) {
-		dev_err(dev, "Vendor request 'link status' failed\n");
-		return;
+		goto retry;
 	}
 
 	hw_addr[0] = hi >> 8;
@@ -796,6 +867,67 @@ static void wq_netinfo(struct work_struct *wq_obj)
 
 	if (mdev->on_netinfo)
 		mdev->on_netinfo(&mdev->iface, link, hw_addr);
+	if (is_valid_ether_addr(hw_addr))
+		return;
+
+	/* no MAC address assigned yet */
+retry:
+	/* report again with the next poll */
+	mdev->netinfo_valid = false;
+}
+
+/**
+ * hdm_set_mep_hash - set the MEP multicast hash table
+ * @iface: interface
+ * @hash: hash table, four 16 bit words
+ *
+ * The DRCI registers are written by means of synchronous control requests,
+ * whereas the network stack calls this with the address list lock held.
+ * Hence only the latest table is stored here and written by a work item.
+ * Whether the INIC applies the table depends on the filter mode in
+ * DRCI_REG_MEP_FILTER, which is left as configured via sysfs because its
+ * bit layout differs between devices.
+ */
+static void hdm_set_mep_hash(struct most_interface *iface, const u16 *hash)
+{
+	struct most_dev *mdev = to_mdev(iface);
+	unsigned long flags;
+
+	spin_lock_irqsave(&mdev->mep_lock, flags);
+	memcpy(mdev->mep_hash, hash, sizeof(mdev->mep_hash));
+	spin_unlock_irqrestore(&mdev->mep_lock, flags);
+	schedule_work(&mdev->mep_work);
+}
+
+/**
+ * wq_mep_hash - work queue function writing the MEP hash table
+ * @wq_obj: work_struct object to execute
+ */
+static void wq_mep_hash(struct work_struct *wq_obj)
+{
+	struct most_dev *mdev = container_of(wq_obj, struct most_dev, mep_work);
+	unsigned long flags;
+	u16 hash[4];
+	int i;
+
+	spin_lock_irqsave(&mdev->mep_lock, flags);
+	memcpy(hash, mdev->mep_hash, sizeof(hash));
+	spin_unlock_irqrestore(&mdev->mep_lock, flags);
+
+	mutex_lock(&mdev->io_mutex);
+	if (!mdev->usb_device)
+		goto unlock;
+
+	for (i = 0; i < ARRAY_SIZE(hash); i++) {
+		if (drci_wr_reg(mdev->usb_device, DRCI_REG_HASH_TBL0 + i,
+				hash[i]) < 0) {
+			dev_err(&mdev->usb_device->dev,
+				"Vendor request 'mep_hash%d' failed\n", i);
+			break;
+		}
+	}
+unlock:
+	mutex_unlock(&mdev->io_mutex);
 }
 
 /**
@@ -1138,16 +1270,18 @@ hdm_probe(struct usb_interface *interface, const struct usb_device_id *id)
 	num_endpoints = usb_iface_desc->desc.bNumEndpoints;
 	mutex_init(&mdev->io_mutex);
 	INIT_WORK(&mdev->poll_work_obj, wq_netinfo);
+	spin_lock_init(&mdev->mep_lock);
+	INIT_WORK(&mdev->mep_work, wq_mep_hash);
 	setup_timer(&mdev->link_stat_timer, link_stat_timer_handler,
 		    (unsigned long)mdev);
 
 	mdev->usb_device = usb_dev;
-	mdev->link_stat_timer.expires = jiffies + (2 * HZ);
 
 	mdev->iface.mod = hdm_usb_fops.owner;
 	mdev->iface.interface = ITYPE_USB;
 	mdev->iface.configure = hdm_configure_channel;
 	mdev->iface.request_netinfo = hdm_request_netinfo;
+	mdev->iface.set_mep_hash = hdm_set_mep_hash;
 	mdev->iface.enqueue = hdm_enqueue;
 	mdev->iface.poison_channel = hdm_poison_channel;
 	mdev->iface.description = mdev->description;
@@ -1181,6 +1315,22 @@ hdm_probe(struct usb_interface *interface, const struct usb_device_id *id)
 	if (!mdev->busy_urbs)
 		goto exit_free3;
 
+	mdev->ni_urb = usb_alloc_urb(0, GFP_KERNEL);
+	mdev->ni_setup = kzalloc(sizeof(*mdev->ni_setup), GFP_KERNEL);
+	mdev->ni_buf = kzalloc(sizeof(*mdev->ni_buf), GFP_KERNEL);
+	if (!mdev->ni_urb || !mdev->ni_setup || !mdev->ni_buf)
+		goto exit_free5;
+
+	mdev->ni_setup->bRequestType =
+		USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE;
+	mdev->ni_setup->bRequest = DRCI_READ_REQ;
+	mdev->ni_setup->wIndex = cpu_to_le16(DRCI_REG_NI_STATE);
+	mdev->ni_setup->wLength = cpu_to_le16(sizeof(*mdev->ni_buf));
+	usb_fill_control_urb(mdev->ni_urb, usb_dev, usb_rcvctrlpipe(usb_dev, 0),
+			     (u8 *)mdev->ni_setup, mdev->ni_buf,
+			     sizeof(*mdev->ni_buf), hdm_ni_state_completion,
+			     mdev);
+
 	tmp_cap = mdev->cap;
 	for (i = 0; i < num_endpoints; i++) {
 		ep_desc = &usb_iface_desc->endpoint[i].desc;
@@ -1221,7 +1371,7 @@ hdm_probe(struct usb_interface *interface, const struct usb_device_id *id)
 	mdev->parent = most_register_interface(&mdev->iface);
 	if (IS_ERR(mdev->parent)) {
 		ret = PTR_ERR(mdev->parent);
-		goto exit_free4;
+		goto exit_free5;
 	}
 
 	mutex_lock(&mdev->io_mutex);
@@ -1236,7 +1386,7 @@ hdm_probe(struct usb_interface *interface, const struct usb_device_id *id)
 			mutex_unlock(&mdev->io_mutex);
 			most_deregister_interface(&mdev->iface);
 			ret = -ENOMEM;
-			goto exit_free4;
+			goto exit_free5;
 		}
 
 		kobject_uevent(&mdev->dci->kobj, KOBJ_ADD);
@@ -1245,7 +1395,10 @@ hdm_probe(struct usb_interface *interface, const struct usb_device_id *id)
 	mutex_unlock(&mdev->io_mutex);
 	return 0;
 
-exit_free4:
+exit_free5:
+	usb_free_urb(mdev->ni_urb);
+	kfree(mdev->ni_setup);
+	kfree(mdev->ni_buf);
 	kfree(mdev->busy_urbs);
 exit_free3:
 	kfree(mdev->ep_address);
@@ -1282,11 +1435,16 @@ static void hdm_disconnect(struct usb_interface *interface)
 	mutex_unlock(&mdev->io_mutex);
 
 	del_timer_sync(&mdev->link_stat_timer);
+	usb_poison_urb(mdev->ni_urb);
 	cancel_work_sync(&mdev->poll_work_obj);
 
 	destroy_most_dci_obj(mdev->dci);
 	most_deregister_interface(&mdev->iface);
+	cancel_work_sync(&mdev->mep_work);
 
+	usb_free_urb(mdev->ni_urb);
+	kfree(mdev->ni_setup);
+	kfree(mdev->ni_buf);
 	kfree(mdev->busy_urbs);
 	kfree(mdev->cap);
 	kfree(mdev->conf);
@@ -1299,6 +1457,7 @@ static struct usb_driver hdm_usb = {
 	.id_table = usbid,
 	.probe = hdm_probe,
 	.disconnect = hdm_disconnect,
+	.drvwrap.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 };
 
 static int __init hdm_usb_init(void)
@@ -14,6 +14,7 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/init.h>
 #include <linux/device.h>
@@ -27,17 +28,39 @@
 #include <linux/kthread.h>
 #include <linux/dma-mapping.h>
 #include <linux/idr.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
 #include "mostcore.h"
 
 #define MAX_CHANNELS	64
 #define STRING_SIZE	80
 
+/* MBOs moved between a per-CPU cache and the channel fifo at once */
+#define MBO_CACHE_BATCH		4
+/* minimum pool size of a Tx channel to make use of the per-CPU caches */
+#define MBO_CACHE_MIN_BUFFERS	(4 * MBO_CACHE_BATCH)
+/* initial pool size of a Tx channel with lazy buffer allocation */
+#define MBO_LAZY_INITIAL_BUFFERS	2
+
 static struct class *most_class;
 static struct device *core_dev;
 static struct ida mdev_id;
 static int dummy_num_buffers;
+/* marks MBOs a lone AIM took from the per-CPU caches, see mbo_cache_share() */
+static int uncharged_num_buffers;
+static struct kmem_cache *mbo_slab;
+
+/* command line parameter to bound the coherent memory of all MBOs */
+static unsigned int dma_budget_kb;
+module_param(dma_budget_kb, uint, 0644);
+MODULE_PARM_DESC(dma_budget_kb, "Coherent memory available to the MBOs of all interfaces in KiB (0 = unlimited)");
+
+static DEFINE_SPINLOCK(dma_budget_lock);
+static u64 dma_usage; /* protected by dma_budget_lock */
 static struct list_head config_probes;
 struct mutex config_probes_mt; /* config_probes */
+static struct mutex instance_list_mt; /* instance_list */
+static struct workqueue_struct *most_wq;
 
 struct most_c_aim_obj {
 	struct most_aim *ptr;
@@ -45,30 +68,71 @@ struct most_c_aim_obj {
 	int num_buffers;
 };
 
+/**
+ * struct most_mbo_cache - per-CPU cache of free Tx MBOs
+ * @lock: protects the cache; only contended when a CPU steals from another
+ * @list: free MBOs
+ * @count: number of MBOs in the list
+ * @uncharged: MBOs taken on this CPU while a single AIM used the channel,
+ *	minus those returned on this CPU in that state
+ */
+struct most_mbo_cache {
+	spinlock_t lock;
+	struct list_head list;
+	unsigned int count;
+	int uncharged;
+};
+
+/*
+ * The channel object is split into cache line aligned groups: the
+ * configuration read on every transfer, the fifos shared by the AIM and the
+ * completion path, the state of the HDM enqueue thread and the cold sysfs
+ * and setup data.  Check the layout with "pahole -C most_c_obj".
+ */
 struct most_c_obj {
-	struct kobject kobj;
-	struct completion cleanup;
-	atomic_t mbo_ref;
-	atomic_t mbo_nq_level;
-	u16 channel_id;
-	bool is_poisoned;
-	struct mutex start_mutex;
-	struct mutex nq_mutex; /* nq thread synchronization */
-	int is_starving;
+	/* read mostly */
 	struct most_interface *iface;
 	struct most_inst_obj *inst;
 	struct most_channel_config cfg;
-	bool keep_mbo;
-	bool enqueue_halt;
-	struct list_head fifo;
-	spinlock_t fifo_lock;
-	struct list_head halt_fifo;
-	struct list_head list;
+	u16 channel_id;
+	bool use_mbo_cache;
+	bool mbo_shared;
+	bool lazy_alloc;
+	bool lazy_pool;
+	struct most_mbo_cache __percpu *mbo_cache;
+	int *solo_num_buffers_ptr;
 	struct most_c_aim_obj aim0;
 	struct most_c_aim_obj aim1;
+	struct mbo **mbo_table;
+
+	/* buffer exchange between AIM and completion path */
+	spinlock_t fifo_lock ____cacheline_aligned_in_smp;
+	bool is_poisoned;
+	struct list_head fifo;
+	struct list_head halt_fifo;
 	struct list_head trash_fifo;
+	atomic_t mbo_allocated;
+
+	/* HDM enqueue thread */
+	wait_queue_head_t hdm_fifo_wq ____cacheline_aligned_in_smp;
+	struct mutex nq_mutex; /* nq thread synchronization */
 	struct task_struct *hdm_enqueue_task;
-	wait_queue_head_t hdm_fifo_wq;
+	atomic_t mbo_nq_level;
+	int is_starving;
+	bool enqueue_halt;
+
+	/* setup and sysfs */
+	struct kobject kobj ____cacheline_aligned_in_smp;
+	struct completion cleanup;
+	struct work_struct grow_work;
+	void *pool_virt;
+	dma_addr_t pool_dma;
+	atomic_t mbo_ref;
+	struct mutex start_mutex;
+	/* protects aim0.ptr and aim1.ptr, nests in instance_list_mt */
+	struct mutex link_mutex;
+	bool keep_mbo;
+	struct list_head list;
 };
 
 #define to_c_obj(d) container_of(d, struct most_c_obj, kobj)
@@ -80,6 +144,8 @@ struct most_inst_obj {
 	struct most_c_obj *channel[MAX_CHANNELS];
 	struct kobject kobj;
 	struct list_head list;
+	struct work_struct autoconf_work;
+	atomic64_t dma_usage;
 };
 
 static const struct {
@@ -172,6 +238,66 @@ static const struct sysfs_ops most_channel_sysfs_ops = {
 	.store = channel_attr_store,
 };
 
+/**
+ * mbo_dma_size - coherent memory taken by the buffer of one MBO
+ * @c: pointer to channel object
+ *
+ * Coherent allocations are page granular, hence the budget is charged
+ * with whole pages.
+ */
+static inline u64 mbo_dma_size(struct most_c_obj *c)
+{
+	return PAGE_ALIGN(c->cfg.buffer_size + c->cfg.extra_len);
+}
+
+/* allocates the buffer of an MBO on a channel with page_buffers set */
+static inline struct page *alloc_mbo_page(struct most_c_obj *c, gfp_t gfp)
+{
+	return alloc_pages(gfp | __GFP_COMP,
+			   get_order(c->cfg.buffer_size + c->cfg.extra_len));
+}
+
+/**
+ * dma_budget_charge - account coherent memory against the DMA budget
+ * @c: channel the memory is used for
+ * @size: number of bytes
+ *
+ * Returns 0 on success or -ENOBUFS if the allocation would exceed the
+ * budget given by the module parameter dma_budget_kb.
+ */
+static int dma_budget_charge(struct most_c_obj *c, u64 size)
+{
+	u64 budget = (u64)READ_ONCE(dma_budget_kb) * 1024;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dma_budget_lock, flags);
+	if (budget && dma_usage + size > budget) {
+		spin_unlock_irqrestore(&dma_budget_lock, flags);
+		return -ENOBUFS;
+	}
+	dma_usage += size;
+	spin_unlock_irqrestore(&dma_budget_lock, flags);
+
+	atomic64_add(size, &c->inst->dma_usage);
+	return 0;
+}
+
+/**
+ * dma_budget_uncharge - give coherent memory back to the DMA budget
+ * @c: channel the memory was used for
+ * @size: number of bytes
+ */
+static void dma_budget_uncharge(struct most_c_obj *c, u64 size)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dma_budget_lock, flags);
+	dma_usage -= size;
+	spin_unlock_irqrestore(&dma_budget_lock, flags);
+
+	atomic64_sub(size, &c->inst->dma_usage);
+}
+
 /**
  * most_free_mbo_coherent - free an MBO and its coherent buffer
  * @mbo: buffer to be released
@@ -182,9 +308,13 @@ static void most_free_mbo_coherent(struct mbo *mbo)
 	struct most_c_obj *c = mbo->context;
 	u16 const coherent_buf_size = c->cfg.buffer_size + c->cfg.extra_len;
 
-	dma_free_coherent(NULL, coherent_buf_size, mbo->virt_address,
-			  mbo->bus_address);
-	kfree(mbo);
+	if (c->cfg.page_buffers)
+		put_page(virt_to_page(mbo->virt_address));
+	else if (!c->pool_virt)
+		dma_free_coherent(NULL, coherent_buf_size, mbo->virt_address,
+				  mbo->bus_address);
+	kmem_cache_free(mbo_slab, mbo);
+	dma_budget_uncharge(c, mbo_dma_size(c));
 	if (atomic_sub_and_test(1, &c->mbo_ref))
 		complete(&c->cleanup);
 }
@@ -197,6 +327,19 @@ static void flush_channel_fifos(struct most_c_obj *c)
 {
 	unsigned long flags, hf_flags;
 	struct mbo *mbo, *tmp;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct most_mbo_cache *pc = per_cpu_ptr(c->mbo_cache, cpu);
+
+		spin_lock_irqsave(&pc->lock, flags);
+		spin_lock(&c->fifo_lock);
+		list_splice_tail_init(&pc->list, &c->fifo);
+		pc->count = 0;
+		pc->uncharged = 0;
+		spin_unlock(&c->fifo_lock);
+		spin_unlock_irqrestore(&pc->lock, flags);
+	}
 
 	if (list_empty(&c->fifo) && list_empty(&c->halt_fifo))
 		return;
@@ -251,6 +394,7 @@ static void most_channel_release(struct kobject *kobj)
 {
 	struct most_c_obj *c = to_c_obj(kobj);
 
+	free_percpu(c->mbo_cache);
 	kfree(c);
 }
 
@@ -335,6 +479,25 @@ static ssize_t channel_starving_show(struct most_c_obj *c,
 	return snprintf(buf, PAGE_SIZE, "%d\n", c->is_starving);
 }
 
+static ssize_t lazy_alloc_show(struct most_c_obj *c,
+			       struct most_c_attr *attr,
+			       char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d\n", c->lazy_alloc);
+}
+
+static ssize_t lazy_alloc_store(struct most_c_obj *c,
+				struct most_c_attr *attr,
+				const char *buf,
+				size_t count)
+{
+	int ret = kstrtobool(buf, &c->lazy_alloc);
+
+	if (ret)
+		return ret;
+	return count;
+}
+
 static ssize_t set_number_of_buffers_show(struct most_c_obj *c,
 					  struct most_c_attr *attr,
 					  char *buf)
@@ -490,6 +653,7 @@ static struct most_c_attr most_c_attrs[] = {
 	__ATTR_RW(set_datatype),
 	__ATTR_RW(set_subbuffer_size),
 	__ATTR_RW(set_packets_per_xact),
+	__ATTR_RW(lazy_alloc),
 };
 
 /**
@@ -509,6 +673,7 @@ static struct attribute *most_channel_def_attrs[] = {
 	&most_c_attrs[10].attr,
 	&most_c_attrs[11].attr,
 	&most_c_attrs[12].attr,
+	&most_c_attrs[13].attr,
 	NULL,
 };
 
@@ -533,10 +698,22 @@ create_most_c_obj(const char *name, struct kobject *parent)
 {
 	struct most_c_obj *c;
 	int retval;
+	int cpu;
 
 	c = kzalloc(sizeof(*c), GFP_KERNEL);
 	if (!c)
 		return NULL;
+	c->mbo_cache = alloc_percpu(struct most_mbo_cache);
+	if (!c->mbo_cache) {
+		kfree(c);
+		return NULL;
+	}
+	for_each_possible_cpu(cpu) {
+		struct most_mbo_cache *pc = per_cpu_ptr(c->mbo_cache, cpu);
+
+		spin_lock_init(&pc->lock);
+		INIT_LIST_HEAD(&pc->list);
+	}
 	c->kobj.kset = most_channel_kset;
 	retval = kobject_init_and_add(&c->kobj, &most_channel_ktype, parent,
 				      "%s", name);
@@ -646,6 +823,14 @@ static ssize_t description_show(struct most_inst_obj *instance_obj,
 			instance_obj->iface->description);
 }
 
+static ssize_t dma_usage_show(struct most_inst_obj *instance_obj,
+			      struct most_inst_attribute *attr,
+			      char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%lld\n",
+			(long long)atomic64_read(&instance_obj->dma_usage));
+}
+
 static ssize_t interface_show(struct most_inst_obj *instance_obj,
 			      struct most_inst_attribute *attr,
 			      char *buf)
@@ -679,9 +864,13 @@ static struct most_inst_attribute most_inst_attr_description =
 static struct most_inst_attribute most_inst_attr_interface =
 	__ATTR_RO(interface);
 
+static struct most_inst_attribute most_inst_attr_dma_usage =
+	__ATTR_RO(dma_usage);
+
 static struct attribute *most_inst_def_attrs[] = {
 	&most_inst_attr_description.attr,
 	&most_inst_attr_interface.attr,
+	&most_inst_attr_dma_usage.attr,
 	NULL,
 };
 
@@ -841,6 +1030,7 @@ static ssize_t links_show(struct most_aim_obj *aim_obj,
 	struct most_inst_obj *i;
 	int offs = 0;
 
+	mutex_lock(&instance_list_mt);
 	list_for_each_entry(i, &instance_list, list) {
 		list_for_each_entry(c, &i->channel_list, list) {
 			if (c->aim0.ptr == aim_obj->driver ||
@@ -852,6 +1042,7 @@ static ssize_t links_show(struct most_aim_obj *aim_obj,
 			}
 		}
 	}
+	mutex_unlock(&instance_list_mt);
 
 	return offs;
 }
@@ -900,6 +1091,7 @@ static int split_string(char *buf, char **a, char **b, char **c)
  * @mdev_ch: name of the respective channel
  *
  * This retrieves the pointer to a channel object.
+ * The caller must hold instance_list_mt.
  */
 static struct
 most_c_obj *get_channel_by_name(char *mdev, char *mdev_ch)
@@ -928,6 +1120,7 @@ most_c_obj *get_channel_by_name(char *mdev, char *mdev_ch)
 	return c;
 }
 
+/* Called with c->link_mutex held */
 static int link_channel_to_aim(struct most_c_obj *c, struct most_aim *aim,
 			       char *aim_param)
 {
@@ -1000,11 +1193,17 @@ static ssize_t add_link_store(struct most_aim_obj *aim_obj,
 		aim_param = devnod_buf;
 	}
 
+	mutex_lock(&instance_list_mt);
 	c = get_channel_by_name(mdev, mdev_ch);
-	if (IS_ERR(c))
+	if (IS_ERR(c)) {
+		mutex_unlock(&instance_list_mt);
 		return -ENODEV;
+	}
 
+	mutex_lock(&c->link_mutex);
 	ret = link_channel_to_aim(c, aim_obj->driver, aim_param);
+	mutex_unlock(&c->link_mutex);
+	mutex_unlock(&instance_list_mt);
 	if (ret)
 		return ret;
 
@@ -1038,16 +1237,25 @@ static ssize_t remove_link_store(struct most_aim_obj *aim_obj,
 	if (ret)
 		return ret;
 
+	mutex_lock(&instance_list_mt);
 	c = get_channel_by_name(mdev, mdev_ch);
-	if (IS_ERR(c))
+	if (IS_ERR(c)) {
+		mutex_unlock(&instance_list_mt);
 		return -ENODEV;
+	}
 
-	if (aim_obj->driver->disconnect_channel(c->iface, c->channel_id))
+	mutex_lock(&c->link_mutex);
+	if (aim_obj->driver->disconnect_channel(c->iface, c->channel_id)) {
+		mutex_unlock(&c->link_mutex);
+		mutex_unlock(&instance_list_mt);
 		return -EIO;
+	}
 	if (c->aim0.ptr == aim_obj->driver)
 		c->aim0.ptr = NULL;
 	if (c->aim1.ptr == aim_obj->driver)
 		c->aim1.ptr = NULL;
+	mutex_unlock(&c->link_mutex);
+	mutex_unlock(&instance_list_mt);
 	return len;
 }
 
@@ -1218,6 +1426,185 @@ static int run_enqueue_thread(struct most_c_obj *c, int channel_id)
 	return 0;
 }
 
+/**
+ * get_cached_mbo - get a free MBO of a Tx channel using the per-CPU caches
+ * @c: pointer to channel object
+ *
+ * This takes an MBO from the cache of the local CPU.  An empty cache is
+ * refilled with a batch of MBOs from the channel fifo.  If the channel fifo
+ * is empty as well, the caches of the other CPUs are searched, so no free
+ * MBO is hidden from the caller.
+ *
+ * Returns a pointer to MBO on success or NULL otherwise.
+ */
+static struct mbo *get_cached_mbo(struct most_c_obj *c)
+{
+	struct most_mbo_cache *pc;
+	struct mbo *mbo = NULL;
+	unsigned long flags;
+	int cpu;
+
+	local_irq_save(flags);
+	pc = this_cpu_ptr(c->mbo_cache);
+	spin_lock(&pc->lock);
+	if (!pc->count) {
+		spin_lock(&c->fifo_lock);
+		while (pc->count < MBO_CACHE_BATCH && !list_empty(&c->fifo)) {
+			list_move_tail(c->fifo.next, &pc->list);
+			pc->count++;
+		}
+		spin_unlock(&c->fifo_lock);
+	}
+	if (pc->count) {
+		mbo = list_pop_mbo(&pc->list);
+		pc->count--;
+	}
+	spin_unlock(&pc->lock);
+	local_irq_restore(flags);
+
+	if (mbo)
+		return mbo;
+
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(c->mbo_cache, cpu);
+		if (!READ_ONCE(pc->count))
+			continue;
+
+		spin_lock_irqsave(&pc->lock, flags);
+		if (pc->count) {
+			mbo = list_pop_mbo(&pc->list);
+			pc->count--;
+		}
+		spin_unlock_irqrestore(&pc->lock, flags);
+		if (mbo)
+			break;
+	}
+	return mbo;
+}
+
+/**
+ * put_cached_mbo - return a free MBO of a Tx channel to the per-CPU cache
+ * @c: pointer to channel object
+ * @mbo: buffer object
+ *
+ * A cache that has grown beyond twice the batch size hands a batch of
+ * MBOs back to the channel fifo, where they are visible to all CPUs.
+ */
+static void put_cached_mbo(struct most_c_obj *c, struct mbo *mbo)
+{
+	int *num_buffers_ptr = mbo->num_buffers_ptr;
+	struct most_mbo_cache *pc;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	pc = this_cpu_ptr(c->mbo_cache);
+	spin_lock(&pc->lock);
+	if (num_buffers_ptr == &uncharged_num_buffers) {
+		if (smp_load_acquire(&c->mbo_shared))
+			num_buffers_ptr = c->solo_num_buffers_ptr;
+		else
+			pc->uncharged--;
+	}
+	if (num_buffers_ptr != &uncharged_num_buffers &&
+	    num_buffers_ptr != &dummy_num_buffers) {
+		spin_lock(&c->fifo_lock);
+		++*num_buffers_ptr;
+		spin_unlock(&c->fifo_lock);
+	}
+	list_add(&mbo->list, &pc->list);
+	if (++pc->count > 2 * MBO_CACHE_BATCH) {
+		spin_lock(&c->fifo_lock);
+		while (pc->count > MBO_CACHE_BATCH) {
+			list_move_tail(pc->list.prev, &c->fifo);
+			pc->count--;
+		}
+		spin_unlock(&c->fifo_lock);
+	}
+	spin_unlock(&pc->lock);
+	local_irq_restore(flags);
+}
+
+/**
+ * mbo_cache_charge - account an MBO taken from the per-CPU caches
+ * @c: pointer to channel object
+ * @num_buffers_ptr: buffer counter of the AIM taking the MBO
+ *
+ * While a single AIM uses the channel, the MBO is only counted in the cache
+ * of the local CPU and is charged to the AIM in case a second AIM joins.
+ *
+ * Returns the counter to be credited when the MBO comes back.
+ */
+static int *mbo_cache_charge(struct most_c_obj *c, int *num_buffers_ptr)
+{
+	struct most_mbo_cache *pc;
+	unsigned long flags;
+
+	if (num_buffers_ptr == &dummy_num_buffers)
+		return num_buffers_ptr;
+
+	local_irq_save(flags);
+	pc = this_cpu_ptr(c->mbo_cache);
+	spin_lock(&pc->lock);
+	if (READ_ONCE(c->mbo_shared)) {
+		spin_lock(&c->fifo_lock);
+		--*num_buffers_ptr;
+		spin_unlock(&c->fifo_lock);
+	} else {
+		pc->uncharged++;
+		num_buffers_ptr = &uncharged_num_buffers;
+	}
+	spin_unlock(&pc->lock);
+	local_irq_restore(flags);
+	return num_buffers_ptr;
+}
+
+/**
+ * mbo_cache_share - switch the per AIM accounting of a cached channel
+ * @c: pointer to channel object
+ * @solo_num_buffers_ptr: counter of the AIM that has used the channel alone
+ *	so far, NULL if the channel is left to a single AIM again
+ *
+ * When a second AIM joins, the MBOs the first one has taken without being
+ * charged are charged to it now, and the free MBOs go back to the channel
+ * fifo.  A put reading mbo_shared under the lock of its cache either sees
+ * the old state and is part of the sum, or credits the AIM afterwards.
+ *
+ * Called with start_mutex held.
+ */
+static void mbo_cache_share(struct most_c_obj *c, int *solo_num_buffers_ptr)
+{
+	struct most_mbo_cache *pc;
+	unsigned long flags;
+	int uncharged = 0;
+	int cpu;
+
+	if (!c->use_mbo_cache)
+		return;
+
+	if (!solo_num_buffers_ptr) {
+		WRITE_ONCE(c->mbo_shared, false);
+		return;
+	}
+
+	c->solo_num_buffers_ptr = solo_num_buffers_ptr;
+	smp_store_release(&c->mbo_shared, true);
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(c->mbo_cache, cpu);
+		spin_lock_irqsave(&pc->lock, flags);
+		spin_lock(&c->fifo_lock);
+		uncharged += pc->uncharged;
+		pc->uncharged = 0;
+		list_splice_tail_init(&pc->list, &c->fifo);
+		pc->count = 0;
+		spin_unlock(&c->fifo_lock);
+		spin_unlock_irqrestore(&pc->lock, flags);
+	}
+
+	spin_lock_irqsave(&c->fifo_lock, flags);
+	*solo_num_buffers_ptr -= uncharged;
+	spin_unlock_irqrestore(&c->fifo_lock, flags);
+}
+
 /**
  * arm_mbo - recycle MBO for further usage
  * @mbo: buffer object
@@ -1229,6 +1616,15 @@ static int run_enqueue_thread(struct most_c_obj *c, int channel_id)
  * poisoned, the MBO is scheduled to be trashed.
  * Calls the completion handler of an attached AIM.
  */
+static void notify_tx_aims(struct most_c_obj *c)
+{
+	if (c->aim0.refs && c->aim0.ptr->tx_completion)
+		c->aim0.ptr->tx_completion(c->iface, c->channel_id);
+
+	if (c->aim1.refs && c->aim1.ptr->tx_completion)
+		c->aim1.ptr->tx_completion(c->iface, c->channel_id);
+}
+
 static void arm_mbo(struct mbo *mbo)
 {
 	unsigned long flags;
@@ -1242,16 +1638,92 @@ static void arm_mbo(struct mbo *mbo)
 		return;
 	}
 
-	spin_lock_irqsave(&c->fifo_lock, flags);
-	++*mbo->num_buffers_ptr;
-	list_add_tail(&mbo->list, &c->fifo);
-	spin_unlock_irqrestore(&c->fifo_lock, flags);
+	if (c->use_mbo_cache) {
+		put_cached_mbo(c, mbo);
+	} else {
+		spin_lock_irqsave(&c->fifo_lock, flags);
+		++*mbo->num_buffers_ptr;
+		list_add_tail(&mbo->list, &c->fifo);
+		spin_unlock_irqrestore(&c->fifo_lock, flags);
+	}
 
-	if (c->aim0.refs && c->aim0.ptr->tx_completion)
-		c->aim0.ptr->tx_completion(c->iface, c->channel_id);
+	notify_tx_aims(c);
+}
 
-	if (c->aim1.refs && c->aim1.ptr->tx_completion)
-		c->aim1.ptr->tx_completion(c->iface, c->channel_id);
+/**
+ * alloc_mbo_pool_block - allocates the coherent buffers of all MBOs at once
+ * @c: pointer to channel object
+ *
+ * A single block lets most_mmap_buffers() map the buffers with one call.
+ * Lazily allocated pools and channels with page buffers go without, and so
+ * does a channel whose block cannot be allocated, in which case every MBO
+ * gets a buffer of its own.
+ */
+static void alloc_mbo_pool_block(struct most_c_obj *c)
+{
+	if (c->lazy_pool || c->cfg.page_buffers)
+		return;
+	c->pool_virt = dma_alloc_coherent(NULL,
+					  c->cfg.num_buffers * mbo_dma_size(c),
+					  &c->pool_dma,
+					  GFP_KERNEL | __GFP_NOWARN);
+}
+
+/* frees the block, once all MBOs of the channel are gone */
+static void free_mbo_pool_block(struct most_c_obj *c)
+{
+	if (!c->pool_virt)
+		return;
+	dma_free_coherent(NULL, c->cfg.num_buffers * mbo_dma_size(c),
+			  c->pool_virt, c->pool_dma);
+	c->pool_virt = NULL;
+}
+
+/**
+ * alloc_mbo - allocates an MBO including its DMA coherent buffer
+ * @c: pointer to interface channel
+ * @compl: pointer to completion function
+ * @gfp: allocation flags
+ * @index: position of the MBO in the pool of the channel
+ *
+ * Returns a pointer to the MBO or NULL if out of memory.
+ */
+static struct mbo *alloc_mbo(struct most_c_obj *c,
+			     void (*compl)(struct mbo *), gfp_t gfp,
+			     unsigned int index)
+{
+	struct mbo *mbo;
+	u32 coherent_buf_size = c->cfg.buffer_size + c->cfg.extra_len;
+
+	mbo = kmem_cache_zalloc(mbo_slab, gfp);
+	if (!mbo)
+		return NULL;
+	mbo->context = c;
+	mbo->ifp = c->iface;
+	mbo->hdm_channel_id = c->channel_id;
+	if (c->cfg.page_buffers) {
+		struct page *page = alloc_mbo_page(c, gfp);
+
+		mbo->virt_address = page ? page_address(page) : NULL;
+	} else if (c->pool_virt) {
+		mbo->virt_address = c->pool_virt + index * mbo_dma_size(c);
+		mbo->bus_address = c->pool_dma + index * mbo_dma_size(c);
+	} else {
+		mbo->virt_address = dma_alloc_coherent(NULL,
+						       coherent_buf_size,
+						       &mbo->bus_address,
+						       gfp);
+	}
+	if (!mbo->virt_address) {
+		pr_info("WARN: No DMA coherent buffer.\n");
+		kmem_cache_free(mbo_slab, mbo);
+		return NULL;
+	}
+	mbo->complete = compl;
+	mbo->num_buffers_ptr = &dummy_num_buffers;
+	mbo->index = index;
+	c->mbo_table[index] = mbo;
+	return mbo;
 }
 
 /**
@@ -1259,6 +1731,7 @@ static void arm_mbo(struct mbo *mbo)
  * @c: pointer to interface channel
  * @dir: direction of the channel
  * @compl: pointer to completion function
+ * @num: number of MBOs to allocate
  *
  * This allocates buffer objects including the containing DMA coherent
  * buffer and puts them in the fifo.
@@ -1268,35 +1741,17 @@ static void arm_mbo(struct mbo *mbo)
  * Returns the number of allocated and enqueued MBOs.
  */
 static int arm_mbo_chain(struct most_c_obj *c, int dir,
-			 void (*compl)(struct mbo *))
+			 void (*compl)(struct mbo *), unsigned int num)
 {
 	unsigned int i;
-	int retval;
 	struct mbo *mbo;
-	u32 coherent_buf_size = c->cfg.buffer_size + c->cfg.extra_len;
 
 	atomic_set(&c->mbo_nq_level, 0);
 
-	for (i = 0; i < c->cfg.num_buffers; i++) {
-		mbo = kzalloc(sizeof(*mbo), GFP_KERNEL);
-		if (!mbo) {
-			retval = i;
-			goto _exit;
-		}
-		mbo->context = c;
-		mbo->ifp = c->iface;
-		mbo->hdm_channel_id = c->channel_id;
-		mbo->virt_address = dma_alloc_coherent(NULL,
-						       coherent_buf_size,
-						       &mbo->bus_address,
-						       GFP_KERNEL);
-		if (!mbo->virt_address) {
-			pr_info("WARN: No DMA coherent buffer.\n");
-			retval = i;
-			goto _error1;
-		}
-		mbo->complete = compl;
-		mbo->num_buffers_ptr = &dummy_num_buffers;
+	for (i = 0; i < num; i++) {
+		mbo = alloc_mbo(c, compl, GFP_KERNEL, i);
+		if (!mbo)
+			break;
 		if (dir == MOST_CH_RX) {
 			nq_hdm_mbo(mbo);
 			atomic_inc(&c->mbo_nq_level);
@@ -1305,11 +1760,6 @@ static int arm_mbo_chain(struct most_c_obj *c, int dir,
 		}
 	}
 	return i;
-
-_error1:
-	kfree(mbo);
-_exit:
-	return retval;
 }
 
 /**
@@ -1336,16 +1786,32 @@ EXPORT_SYMBOL_GPL(most_submit_mbo);
 static void most_write_completion(struct mbo *mbo)
 {
 	struct most_c_obj *c;
+	bool had_sgt = false;
 
 	BUG_ON((!mbo) || (!mbo->context));
 
 	c = mbo->context;
 	if (mbo->status == MBO_E_INVAL)
 		pr_info("WARN: Tx MBO status: invalid\n");
-	if (unlikely(c->is_poisoned || (mbo->status == MBO_E_CLOSE)))
+
+	/* the AIM waits for its pages to be released */
+	if (unlikely(mbo->sgt)) {
+		WRITE_ONCE(mbo->sgt, NULL);
+		had_sgt = true;
+	}
+
+	if (c->aim0.refs && c->aim0.ptr->tx_done)
+		c->aim0.ptr->tx_done(mbo);
+	if (c->aim1.refs && c->aim1.ptr->tx_done)
+		c->aim1.ptr->tx_done(mbo);
+
+	if (unlikely(c->is_poisoned || (mbo->status == MBO_E_CLOSE))) {
 		trash_mbo(mbo);
-	else
+		if (had_sgt)
+			notify_tx_aims(c);
+	} else {
 		arm_mbo(mbo);
+	}
 }
 
 /**
@@ -1376,6 +1842,92 @@ most_c_obj *get_channel_by_iface(struct most_interface *iface, int id)
 	return i->channel[id];
 }
 
+/* marks a slot of mbo_table whose MBO is being allocated */
+#define MBO_SLOT_RESERVED	ERR_PTR(-EBUSY)
+
+/**
+ * grow_mbo_pool - allocates another MBO for a lazily allocated Tx channel
+ * @c: pointer to channel object
+ * @gfp: allocation flags
+ *
+ * The pool grows by one MBO at a time until it reaches the configured
+ * number of buffers.  The slot in mbo_table and the reference on the
+ * channel are taken under fifo_lock, where most_stop_channel() poisons the
+ * channel, so a stopping channel either refuses to grow or waits for the
+ * new MBO.  A failed allocation gives the slot back.
+ *
+ * Returns a pointer to the new MBO or NULL.
+ */
+static struct mbo *grow_mbo_pool(struct most_c_obj *c, gfp_t gfp)
+{
+	unsigned long flags;
+	struct mbo *mbo;
+	int index = -1;
+	int i;
+
+	spin_lock_irqsave(&c->fifo_lock, flags);
+	if (c->lazy_pool && !c->is_poisoned &&
+	    atomic_read(&c->mbo_allocated) < c->cfg.num_buffers) {
+		for (i = 0; i < c->cfg.num_buffers; i++) {
+			if (!c->mbo_table[i]) {
+				index = i;
+				break;
+			}
+		}
+	}
+	if (index < 0) {
+		spin_unlock_irqrestore(&c->fifo_lock, flags);
+		return NULL;
+	}
+	c->mbo_table[index] = MBO_SLOT_RESERVED;
+	atomic_inc(&c->mbo_allocated);
+	atomic_inc(&c->mbo_ref);
+	spin_unlock_irqrestore(&c->fifo_lock, flags);
+
+	if (dma_budget_charge(c, mbo_dma_size(c)))
+		goto err;
+
+	mbo = alloc_mbo(c, most_write_completion, gfp, index);
+	if (!mbo) {
+		dma_budget_uncharge(c, mbo_dma_size(c));
+		goto err;
+	}
+	return mbo;
+
+err:
+	spin_lock_irqsave(&c->fifo_lock, flags);
+	c->mbo_table[index] = NULL;
+	atomic_dec(&c->mbo_allocated);
+	spin_unlock_irqrestore(&c->fifo_lock, flags);
+	if (atomic_sub_and_test(1, &c->mbo_ref))
+		complete(&c->cleanup);
+	return NULL;
+}
+
+/*
+ * grow_mbo_pool_work - grows the pool of a channel on behalf of a caller
+ * that ran out of MBOs, possibly in atomic context.  The new MBO is armed,
+ * which wakes the AIMs through their tx_completion callbacks.
+ */
+static void grow_mbo_pool_work(struct work_struct *work)
+{
+	struct most_c_obj *c = container_of(work, struct most_c_obj,
+					    grow_work);
+	struct mbo *mbo;
+
+	mbo = grow_mbo_pool(c, GFP_KERNEL);
+	if (mbo)
+		arm_mbo(mbo);
+}
+
+/* requests another MBO if the pool of a lazily allocated channel may grow */
+static void request_mbo_pool_growth(struct most_c_obj *c)
+{
+	if (READ_ONCE(c->lazy_pool) && !READ_ONCE(c->is_poisoned) &&
+	    atomic_read(&c->mbo_allocated) < c->cfg.num_buffers)
+		queue_work(most_wq, &c->grow_work);
+}
+
 int channel_has_mbo(struct most_interface *iface, int id, struct most_aim *aim)
 {
 	struct most_c_obj *c = get_channel_by_iface(iface, id);
@@ -1393,7 +1945,21 @@ int channel_has_mbo(struct most_interface *iface, int id, struct most_aim *aim)
 	spin_lock_irqsave(&c->fifo_lock, flags);
 	empty = list_empty(&c->fifo);
 	spin_unlock_irqrestore(&c->fifo_lock, flags);
-	return !empty;
+	if (!empty)
+		return 1;
+
+	if (c->use_mbo_cache) {
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			if (READ_ONCE(per_cpu_ptr(c->mbo_cache, cpu)->count))
+				return 1;
+		}
+	}
+
+	/* the new MBO wakes the caller via tx_completion */
+	request_mbo_pool_growth(c);
+	return 0;
 }
 EXPORT_SYMBOL_GPL(channel_has_mbo);
 
@@ -1402,7 +1968,9 @@ EXPORT_SYMBOL_GPL(channel_has_mbo);
  * @iface: pointer to interface instance
  * @id: channel ID
  *
- * This attempts to get a free buffer out of the channel fifo.
+ * This attempts to get a free buffer out of the channel fifo.  Channels
+ * using per-CPU caches serve the request from the cache of the local CPU.
+ * Channels with lazy allocation grow their pool if no buffer is free.
  * Returns a pointer to MBO on success or NULL otherwise.
  */
 struct mbo *most_get_mbo(struct most_interface *iface, int id,
@@ -1429,15 +1997,32 @@ struct mbo *most_get_mbo(struct most_interface *iface, int id,
 	else
 		num_buffers_ptr = &dummy_num_buffers;
 
+	if (c->use_mbo_cache) {
+		mbo = get_cached_mbo(c);
+		if (!mbo) {
+			request_mbo_pool_growth(c);
+			return NULL;
+		}
+
+		/*
+		 * The per AIM accounting only matters while two AIMs share
+		 * the channel, so the single AIM case stays CPU-local.
+		 */
+		num_buffers_ptr = mbo_cache_charge(c, num_buffers_ptr);
+		goto out;
+	}
+
 	spin_lock_irqsave(&c->fifo_lock, flags);
 	if (list_empty(&c->fifo)) {
 		spin_unlock_irqrestore(&c->fifo_lock, flags);
+		request_mbo_pool_growth(c);
 		return NULL;
 	}
 	mbo = list_pop_mbo(&c->fifo);
 	--*num_buffers_ptr;
 	spin_unlock_irqrestore(&c->fifo_lock, flags);
 
+out:
 	mbo->num_buffers_ptr = num_buffers_ptr;
 	mbo->buffer_length = c->cfg.buffer_size;
 	return mbo;
@@ -1461,6 +2046,116 @@ void most_put_mbo(struct mbo *mbo)
 }
 EXPORT_SYMBOL_GPL(most_put_mbo);
 
+/**
+ * most_detach_mbo_page - takes the buffer away from a received MBO
+ * @mbo: buffer object owned by the caller
+ * @gfp: allocation flags for the replacement buffer
+ *
+ * On channels with page buffers, this gives the MBO a fresh buffer and
+ * hands the old one, including the received data, to the caller, who
+ * releases it with put_page().  The MBO itself still has to be returned
+ * with most_put_mbo().  Must not be used on mapped buffers.
+ *
+ * Returns the page or NULL if the channel has no page buffers or no
+ * replacement could be allocated, in which case the MBO is unchanged.
+ */
+struct page *most_detach_mbo_page(struct mbo *mbo, gfp_t gfp)
+{
+	struct most_c_obj *c = mbo->context;
+	struct page *page, *fresh;
+
+	if (!c->cfg.page_buffers)
+		return NULL;
+	fresh = alloc_mbo_page(c, gfp);
+	if (!fresh)
+		return NULL;
+	page = virt_to_page(mbo->virt_address);
+	mbo->virt_address = page_address(fresh);
+	return page;
+}
+EXPORT_SYMBOL_GPL(most_detach_mbo_page);
+
+/**
+ * most_mmap_buffers - maps the buffers of a channel to user space
+ * @iface: pointer to interface instance
+ * @id: channel ID
+ * @vma: user mapping to populate, covering all buffers and nothing else
+ *
+ * The buffer of the MBO with index n is mapped at n times
+ * PAGE_ALIGN(buffer_size + extra_len), so an AIM can hand out buffers to
+ * user space by their index.  A lazily allocated pool is completed first.
+ * Page buffers are inserted page by page, coherent buffers need the single
+ * block of a channel started without lazy allocation.  The caller must
+ * keep the channel started while the mapping exists and zap it before
+ * stopping the channel.
+ *
+ * Returns 0 on success or error code otherwise.
+ */
+int most_mmap_buffers(struct most_interface *iface, int id,
+		      struct vm_area_struct *vma)
+{
+	struct most_c_obj *c = get_channel_by_iface(iface, id);
+	unsigned long stride, addr;
+	struct page *page;
+	struct mbo *mbo;
+	int ret = 0;
+	int i, j;
+
+	if (unlikely(!c))
+		return -EINVAL;
+
+	/* arming MBOs calls the AIMs, so grow before taking start_mutex */
+	while (READ_ONCE(c->lazy_pool) &&
+	       atomic_read(&c->mbo_allocated) < c->cfg.num_buffers) {
+		mbo = grow_mbo_pool(c, GFP_KERNEL);
+		if (!mbo)
+			return -ENOMEM;
+		arm_mbo(mbo);
+	}
+
+	mutex_lock(&c->start_mutex);
+	if (!c->mbo_table) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	stride = mbo_dma_size(c);
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != c->cfg.num_buffers * stride) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < c->cfg.num_buffers; i++) {
+		if (IS_ERR_OR_NULL(c->mbo_table[i])) {
+			ret = -EAGAIN;
+			goto out;
+		}
+	}
+
+	if (!c->cfg.page_buffers) {
+		if (c->pool_virt)
+			ret = dma_mmap_coherent(NULL, vma, c->pool_virt,
+						c->pool_dma,
+						c->cfg.num_buffers * stride);
+		else
+			ret = -EOPNOTSUPP;
+		goto out;
+	}
+
+	for (i = 0; i < c->cfg.num_buffers && !ret; i++) {
+		page = virt_to_page(c->mbo_table[i]->virt_address);
+		addr = vma->vm_start + i * stride;
+		for (j = 0; j < stride >> PAGE_SHIFT && !ret; j++)
+			ret = vm_insert_page(vma, addr + j * PAGE_SIZE,
+					     page + j);
+	}
+out:
+	mutex_unlock(&c->start_mutex);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(most_mmap_buffers);
+
 /**
  * most_read_completion - read completion handler
  * @mbo: pointer to MBO
@@ -1475,6 +2170,8 @@ static void most_read_completion(struct mbo *mbo)
 {
 	struct most_c_obj *c = mbo->context;
 
+	mbo->timestamp = ktime_get();
+
 	if (unlikely(c->is_poisoned || (mbo->status == MBO_E_CLOSE))) {
 		trash_mbo(mbo);
 		return;
@@ -1514,6 +2211,7 @@ int most_start_channel(struct most_interface *iface, int id,
 		       struct most_aim *aim)
 {
 	int num_buffer;
+	int num_initial;
 	int ret;
 	struct most_c_obj *c = get_channel_by_iface(iface, id);
 
@@ -1531,36 +2229,74 @@ int most_start_channel(struct most_interface *iface, int id,
 	}
 
 	c->cfg.extra_len = 0;
+	c->cfg.dma_sg = false;
+	c->cfg.page_buffers = false;
 	if (c->iface->configure(c->iface, c->channel_id, &c->cfg)) {
 		pr_info("channel configuration failed. Go check settings...\n");
 		ret = -EINVAL;
 		goto error;
 	}
 
+	/* a change of lazy_alloc applies from the next start on */
+	c->lazy_pool = c->lazy_alloc && c->cfg.direction == MOST_CH_TX;
+	num_initial = c->cfg.num_buffers;
+	if (c->lazy_pool)
+		num_initial = min_t(int, num_initial, MBO_LAZY_INITIAL_BUFFERS);
+
+	/* fail before allocating anything if the budget is exhausted */
+	ret = dma_budget_charge(c, num_initial * mbo_dma_size(c));
+	if (ret) {
+		pr_info("DMA budget exceeded by channel %d of mdev %s\n",
+			c->channel_id, c->iface->description);
+		goto error;
+	}
+
+	c->mbo_table = kcalloc(c->cfg.num_buffers, sizeof(*c->mbo_table),
+			       GFP_KERNEL);
+	if (!c->mbo_table) {
+		dma_budget_uncharge(c, num_initial * mbo_dma_size(c));
+		ret = -ENOMEM;
+		goto error;
+	}
+
 	init_waitqueue_head(&c->hdm_fifo_wq);
+	alloc_mbo_pool_block(c);
+
+	c->use_mbo_cache = c->cfg.direction == MOST_CH_TX &&
+			   c->cfg.data_type != MOST_CH_CONTROL &&
+			   c->cfg.num_buffers >= MBO_CACHE_MIN_BUFFERS;
 
 	if (c->cfg.direction == MOST_CH_RX)
 		num_buffer = arm_mbo_chain(c, c->cfg.direction,
-					   most_read_completion);
+					   most_read_completion, num_initial);
 	else
 		num_buffer = arm_mbo_chain(c, c->cfg.direction,
-					   most_write_completion);
+					   most_write_completion, num_initial);
+	if (num_buffer < num_initial)
+		dma_budget_uncharge(c, (num_initial - num_buffer) *
+				       mbo_dma_size(c));
 	if (unlikely(!num_buffer)) {
 		pr_info("failed to allocate memory\n");
 		ret = -ENOMEM;
-		goto error;
+		goto err_free_table;
 	}
 
 	ret = run_enqueue_thread(c, id);
 	if (ret)
-		goto error;
+		goto err_free_table;
 
 	c->is_starving = 0;
+	c->mbo_shared = false;
 	c->aim0.num_buffers = c->cfg.num_buffers / 2;
 	c->aim1.num_buffers = c->cfg.num_buffers - c->aim0.num_buffers;
 	atomic_set(&c->mbo_ref, num_buffer);
+	atomic_set(&c->mbo_allocated, num_buffer);
 
 out:
+	if (aim == c->aim1.ptr && c->aim0.refs && !c->aim1.refs)
+		mbo_cache_share(c, &c->aim0.num_buffers);
+	else if (aim == c->aim0.ptr && c->aim1.refs && !c->aim0.refs)
+		mbo_cache_share(c, &c->aim1.num_buffers);
 	if (aim == c->aim0.ptr)
 		c->aim0.refs++;
 	if (aim == c->aim1.ptr)
@@ -1568,6 +2304,11 @@ out:
 	mutex_unlock(&c->start_mutex);
 	return 0;
 
+err_free_table:
+	if (!num_buffer)
+		free_mbo_pool_block(c);
+	kfree(c->mbo_table);
+	c->mbo_table = NULL;
 error:
 	module_put(iface->mod);
 	mutex_unlock(&c->start_mutex);
@@ -1584,6 +2325,7 @@ int most_stop_channel(struct most_interface *iface, int id,
 		      struct most_aim *aim)
 {
 	struct most_c_obj *c;
+	unsigned long flags;
 
 	if (unlikely((!iface) || (id >= iface->num_channels) || (id < 0))) {
 		pr_err("Bad interface or index out of range\n");
@@ -1604,7 +2346,11 @@ int most_stop_channel(struct most_interface *iface, int id,
 	if (iface->mod)
 		module_put(iface->mod);
 
+	spin_lock_irqsave(&c->fifo_lock, flags);
 	c->is_poisoned = true;
+	c->lazy_pool = false;
+	spin_unlock_irqrestore(&c->fifo_lock, flags);
+	cancel_work_sync(&c->grow_work);
 	if (c->iface->poison_channel(c->iface, c->channel_id)) {
 		pr_err("Cannot stop channel %d of mdev %s\n", c->channel_id,
 		       c->iface->description);
@@ -1623,6 +2369,9 @@ int most_stop_channel(struct most_interface *iface, int id,
 #else
 	wait_for_completion(&c->cleanup);
 #endif
+	free_mbo_pool_block(c);
+	kfree(c->mbo_table);
+	c->mbo_table = NULL;
 	c->is_poisoned = false;
 
 out:
@@ -1630,11 +2379,45 @@ out:
 		c->aim0.refs--;
 	if (aim == c->aim1.ptr)
 		c->aim1.refs--;
+	if (c->aim0.refs + c->aim1.refs && !(c->aim0.refs && c->aim1.refs))
+		mbo_cache_share(c, NULL);
 	mutex_unlock(&c->start_mutex);
 	return 0;
 }
 EXPORT_SYMBOL_GPL(most_stop_channel);
 
+/**
+ * most_set_num_buffers - changes the number of buffers of a channel
+ * @iface: pointer to interface instance
+ * @id: channel ID
+ * @num_buffers: new number of buffers
+ *
+ * Unlike the sysfs attribute this refuses to touch a started channel,
+ * whose MBOs have been allocated with the old number.
+ *
+ * Returns 0 on success or error code otherwise.
+ */
+int most_set_num_buffers(struct most_interface *iface, int id,
+			 u16 num_buffers)
+{
+	struct most_c_obj *c = get_channel_by_iface(iface, id);
+	int ret = 0;
+
+	if (unlikely(!c))
+		return -EINVAL;
+	if (!num_buffers)
+		return -EINVAL;
+
+	mutex_lock(&c->start_mutex);
+	if (c->aim0.refs || c->aim1.refs)
+		ret = -EBUSY;
+	else
+		c->cfg.num_buffers = num_buffers;
+	mutex_unlock(&c->start_mutex);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(most_set_num_buffers);
+
 /**
  * most_register_aim - registers an AIM (driver) with the core
  * @aim: instance of AIM to be registered
@@ -1656,7 +2439,9 @@ int most_register_aim(struct most_aim *aim)
 	aim->context = aim_obj;
 	pr_info("registered new application interfacing module %s\n",
 		aim->name);
+	mutex_lock(&instance_list_mt);
 	list_add_tail(&aim_obj->list, &aim_list);
+	mutex_unlock(&instance_list_mt);
 	return 0;
 }
 EXPORT_SYMBOL_GPL(most_register_aim);
@@ -1681,8 +2466,17 @@ int most_deregister_aim(struct most_aim *aim)
 		pr_info("driver not registered.\n");
 		return -EINVAL;
 	}
+
+	/*
+	 * An automatic configuration that has found this AIM holds the
+	 * link_mutex of its channel, so the channel is disconnected once the
+	 * probe is done.  Later ones no longer find the AIM.
+	 */
+	mutex_lock(&instance_list_mt);
+	list_del(&aim_obj->list);
 	list_for_each_entry_safe(i, i_tmp, &instance_list, list) {
 		list_for_each_entry_safe(c, tmp, &i->channel_list, list) {
+			mutex_lock(&c->link_mutex);
 			if (c->aim0.ptr == aim || c->aim1.ptr == aim)
 				aim->disconnect_channel(
 					c->iface, c->channel_id);
@@ -1690,9 +2484,10 @@ int most_deregister_aim(struct most_aim *aim)
 				c->aim0.ptr = NULL;
 			if (c->aim1.ptr == aim)
 				c->aim1.ptr = NULL;
+			mutex_unlock(&c->link_mutex);
 		}
 	}
-	list_del(&aim_obj->list);
+	mutex_unlock(&instance_list_mt);
 	destroy_most_aim_obj(aim_obj);
 	pr_info("deregistering application interfacing module %s\n", aim->name);
 	return 0;
@@ -1715,55 +2510,115 @@ void most_deregister_config_set(struct most_config_set *cfg_set)
 }
 EXPORT_SYMBOL(most_deregister_config_set);
 
+/**
+ * probe_aim - links a channel to the AIM with the given name
+ * @c: pointer to channel object
+ * @aim_name: name of the AIM
+ * @aim_param: parameter passed to the AIM
+ *
+ * The AIM is looked up under instance_list_mt, which protects aim_list as
+ * well.  The mutex is handed over to the link_mutex of the channel before
+ * the AIM is probed, so that probing (registering a netdev, a sound card
+ * or cdev nodes) runs for several interfaces at a time.  An AIM that goes
+ * away meanwhile waits for the link_mutex in most_deregister_aim().
+ */
 static int probe_aim(struct most_c_obj *c,
 		     const char *aim_name, const char *aim_param)
 {
 	struct most_aim_obj *aim_obj;
 	char buf[STRING_SIZE];
+	int ret;
 
+	mutex_lock(&instance_list_mt);
 	list_for_each_entry(aim_obj, &aim_list, list) {
 		if (!strcmp(aim_obj->driver->name, aim_name)) {
+			mutex_lock(&c->link_mutex);
+			mutex_unlock(&instance_list_mt);
 			strlcpy(buf, aim_param ? aim_param : "", sizeof(buf));
-			return link_channel_to_aim(c, aim_obj->driver, buf);
+			ret = link_channel_to_aim(c, aim_obj->driver, buf);
+			mutex_unlock(&c->link_mutex);
+			return ret;
 		}
 	}
+	mutex_unlock(&instance_list_mt);
 	return 0;
 }
 
-static bool probe_config_set(struct most_c_obj *c,
-			     const char *dev_name, const char *ch_name,
-			     const struct most_config_probe *p)
+static const struct most_config_probe *
+match_config_set(const char *dev_name, const char *ch_name,
+		 const struct most_config_probe *p)
 {
-	int err;
-
 	for (; p->ch_name; p++) {
 		if ((p->dev_name && strcmp(dev_name, p->dev_name)) ||
 		    strcmp(ch_name, p->ch_name))
 			continue;
-
-		c->cfg = p->cfg;
-		if (p->aim_name) {
-			err = probe_aim(c, p->aim_name, p->aim_param);
-			if (err)
-				pr_err("failed to autolink %s to %s: %d\n",
-				       ch_name, p->aim_name, err);
-		}
-		return true;
+		return p;
 	}
-	return false;
+	return NULL;
 }
 
+/**
+ * find_configuration - apply the first matching configuration to a channel
+ * @c: pointer to channel object
+ * @dev_name: description of the interface the channel belongs to
+ * @ch_name: name of the channel
+ *
+ * The matching rule is copied under config_probes_mt, whereas the AIM is
+ * probed without holding it.  Probing an AIM may take long (registering a
+ * netdev or a sound card), which would otherwise also block the rule
+ * updates of other modules.
+ */
 static void find_configuration(struct most_c_obj *c, const char *dev_name,
 			       const char *ch_name)
 {
 	struct most_config_set *plist;
+	const struct most_config_probe *p = NULL;
+	char aim_name[STRING_SIZE] = "";
+	char aim_param[STRING_SIZE] = "";
+	int err;
 
 	mutex_lock(&config_probes_mt);
 	list_for_each_entry(plist, &config_probes, list) {
-		if (probe_config_set(c, dev_name, ch_name, plist->probes))
+		p = match_config_set(dev_name, ch_name, plist->probes);
+		if (p)
 			break;
 	}
+	if (p) {
+		c->cfg = p->cfg;
+		if (p->aim_name)
+			strlcpy(aim_name, p->aim_name, sizeof(aim_name));
+		if (p->aim_param)
+			strlcpy(aim_param, p->aim_param, sizeof(aim_param));
+	}
 	mutex_unlock(&config_probes_mt);
+
+	if (!*aim_name)
+		return;
+
+	err = probe_aim(c, aim_name, aim_param);
+	if (err)
+		pr_err("failed to autolink %s to %s: %d\n",
+		       ch_name, aim_name, err);
+}
+
+/**
+ * autoconf_work_fn - applies the automatic configuration to an interface
+ * @work: autoconf_work of the instance object
+ *
+ * Runs on the unbound most_wq, so several interfaces registered at the same
+ * time are configured in parallel, see probe_aim().  The channels of one
+ * interface are processed in order, as AIMs like networking pair up the
+ * channels of an interface while they get probed.
+ */
+static void autoconf_work_fn(struct work_struct *work)
+{
+	struct most_inst_obj *inst =
+		container_of(work, struct most_inst_obj, autoconf_work);
+	struct most_c_obj *c;
+
+	list_for_each_entry(c, &inst->channel_list, list)
+		find_configuration(c, inst->iface->description,
+				   kobject_name(&c->kobj));
 }
 
 /**
@@ -1771,6 +2626,7 @@ static void find_configuration(struct most_c_obj *c, const char *dev_name,
  * @iface: pointer to the instance of the interface description.
  *
  * Allocates and initializes a new interface instance and all of its channels.
+ * The automatic configuration of the channels is deferred to most_wq.
  * Returns a pointer to kobject or an error pointer.
  */
 struct kobject *most_register_interface(struct most_interface *iface)
@@ -1804,9 +2660,12 @@ struct kobject *most_register_interface(struct most_interface *iface)
 
 	iface->priv = inst;
 	INIT_LIST_HEAD(&inst->channel_list);
+	INIT_WORK(&inst->autoconf_work, autoconf_work_fn);
 	inst->iface = iface;
 	inst->dev_id = id;
+	mutex_lock(&instance_list_mt);
 	list_add_tail(&inst->list, &instance_list);
+	mutex_unlock(&instance_list_mt);
 
 	for (i = 0; i < iface->num_channels; i++) {
 		const char *name_suffix = iface->channel_vector[i].name_suffix;
@@ -1839,19 +2698,23 @@ struct kobject *most_register_interface(struct most_interface *iface)
 		INIT_LIST_HEAD(&c->trash_fifo);
 		INIT_LIST_HEAD(&c->halt_fifo);
 		init_completion(&c->cleanup);
+		INIT_WORK(&c->grow_work, grow_mbo_pool_work);
 		atomic_set(&c->mbo_ref, 0);
 		mutex_init(&c->start_mutex);
+		mutex_init(&c->link_mutex);
 		mutex_init(&c->nq_mutex);
 		list_add_tail(&c->list, &inst->channel_list);
-		find_configuration(c, iface->description, channel_name);
 	}
+	queue_work(most_wq, &inst->autoconf_work);
 	pr_info("registered new MOST device mdev%d (%s)\n",
 		inst->dev_id, iface->description);
 	return &inst->kobj;
 
 free_instance:
 	pr_info("Failed allocate channel(s)\n");
+	mutex_lock(&instance_list_mt);
 	list_del(&inst->list);
+	mutex_unlock(&instance_list_mt);
 	ida_simple_remove(&mdev_id, id);
 	destroy_most_inst_obj(inst);
 	return ERR_PTR(-ENOMEM);
@@ -1877,7 +2740,10 @@ void most_deregister_interface(struct most_interface *iface)
 	pr_info("deregistering MOST device %s (%s)\n", i->kobj.name,
 		iface->description);
 
+	cancel_work_sync(&i->autoconf_work);
+	mutex_lock(&instance_list_mt);
 	list_for_each_entry(c, &i->channel_list, list) {
+		mutex_lock(&c->link_mutex);
 		if (c->aim0.ptr)
 			c->aim0.ptr->disconnect_channel(c->iface,
 							c->channel_id);
@@ -1886,10 +2752,12 @@ void most_deregister_interface(struct most_interface *iface)
 							c->channel_id);
 		c->aim0.ptr = NULL;
 		c->aim1.ptr = NULL;
+		mutex_unlock(&c->link_mutex);
 	}
+	list_del(&i->list);
+	mutex_unlock(&instance_list_mt);
 
 	ida_simple_remove(&mdev_id, i->dev_id);
-	list_del(&i->list);
 	destroy_most_inst_obj(i);
 }
 EXPORT_SYMBOL_GPL(most_deregister_interface);
@@ -1949,12 +2817,34 @@ static int __init most_init(void)
 	INIT_LIST_HEAD(&aim_list);
 	INIT_LIST_HEAD(&config_probes);
 	mutex_init(&config_probes_mt);
+	mutex_init(&instance_list_mt);
 	ida_init(&mdev_id);
 
+#ifdef CONFIG_SMP
+	/* the HDM side of an MBO must not share a cache line with the AIM's */
+	BUILD_BUG_ON(offsetof(struct mbo, priv) / SMP_CACHE_BYTES ==
+		     offsetof(struct mbo, list) / SMP_CACHE_BYTES);
+	BUILD_BUG_ON(offsetof(struct mbo, processed_length) / SMP_CACHE_BYTES ==
+		     offsetof(struct mbo, buffer_length) / SMP_CACHE_BYTES);
+	BUILD_BUG_ON(offsetof(struct most_c_obj, fifo_lock) / SMP_CACHE_BYTES ==
+		     offsetof(struct most_c_obj, kobj) / SMP_CACHE_BYTES);
+#endif
+
+	mbo_slab = kmem_cache_create("most_mbo", sizeof(struct mbo), 0,
+				     SLAB_HWCACHE_ALIGN, NULL);
+	if (!mbo_slab)
+		return -ENOMEM;
+
+	most_wq = alloc_workqueue("most_wq", WQ_UNBOUND, 0);
+	if (!most_wq) {
+		err = -ENOMEM;
+		goto exit_slab;
+	}
+
 	err = bus_register(&most_bus);
 	if (err) {
 		pr_info("Cannot register most bus\n");
-		return err;
+		goto exit_wq;
 	}
 
 	most_class = class_create(THIS_MODULE, "most");
@@ -2000,6 +2890,10 @@ exit_class:
 	class_destroy(most_class);
 exit_bus:
 	bus_unregister(&most_bus);
+exit_wq:
+	destroy_workqueue(most_wq);
+exit_slab:
+	kmem_cache_destroy(mbo_slab);
 	return err;
 }
 
@@ -2023,6 +2917,8 @@ static void __exit most_exit(void)
 	driver_unregister(&mostcore);
 	class_destroy(most_class);
 	bus_unregister(&most_bus);
+	destroy_workqueue(most_wq);
+	kmem_cache_destroy(mbo_slab);
 	ida_destroy(&mdev_id);
 }
 
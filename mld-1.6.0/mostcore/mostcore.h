@@ -23,6 +23,12 @@
 #define __MOST_CORE_H__
 
 #include <linux/types.h>
+#include <linux/cache.h>
+#include <linux/ktime.h>
+
+struct vm_area_struct;
+struct sg_table;
+struct page;
 
 struct kobject;
 struct module;
@@ -125,6 +131,13 @@ struct most_channel_capability {
  * to match to a given interface and channel type.
  * @extra_len: additional buffer space for internal HDM purposes like padding.
  * May be set by HDM in a configure callback if needed.
+ * @dma_sg: HDM accepts Tx MBOs carrying their payload in mbo->sgt instead of
+ * the buffer, in up to DIV_ROUND_UP(buffer_size, PAGE_SIZE) + 1 entries.
+ * May be set by HDM in a configure callback.
+ * @page_buffers: buffers are allocated from pages instead of coherent memory
+ * and the HDM maps them for each transfer. Allows AIMs to pass received
+ * buffers on with most_detach_mbo_page(). May be set by HDM in a configure
+ * callback.
  * @subbuffer_size: size of a subbuffer
  * @packets_per_xact: number of MOST frames that are packet inside one USB
  *		      packet. This is USB specific
@@ -141,6 +154,8 @@ struct most_channel_config {
 	u16 extra_len;
 	u16 subbuffer_size;
 	u16 packets_per_xact;
+	bool dma_sg;
+	bool page_buffers;
 };
 
 /**
@@ -190,8 +205,14 @@ struct most_config_set {
  * @virt_address: (in) kernel virtual address of the buffer
  * @bus_address: (in) bus address of the buffer
  * @buffer_length: (in) buffer payload length
+ * @index: (in) position of the MBO in the buffer pool of its channel
+ * @sgt: (in) if set, the pages holding the payload instead of the buffer.
+ *	 Only used on channels the HDM configured with dma_sg, the HDM
+ *	 maps the pages for DMA. Cleared by the core on completion.
  * @processed_length: (out) processed length
  * @status: (out) transfer status
+ * @timestamp: (out) CLOCK_MONOTONIC completion time of an Rx MBO, taken by
+ *	       the core when the HDM completes it
  * @complete: (in) completion routine
  *
  * The MostCore allocates and initializes the MBO.
@@ -216,20 +237,33 @@ struct most_config_set {
  * is violated memory leaks will occur, since the core driver does _not_ track
  * MBOs it is currently not in control of.
  *
+ *					III.
+ * The fields are grouped by the side writing them.  The first group holds
+ * the fields set up by the core and the AIM before an MBO is enqueued,
+ * which are only read by the HDM, and the list head the core and the AIMs
+ * queue free and received MBOs with.  The fields the HDM writes in its
+ * completion path start on a separate cache line, so completing an MBO
+ * on one CPU does not invalidate the buffer description an AIM is reading
+ * on another one.  Check the layout with "pahole -C mbo" after changing it.
  */
 struct mbo {
 	void *context;
-	void *priv;
-	struct list_head list;
 	struct most_interface *ifp;
-	int *num_buffers_ptr;
-	u16 hdm_channel_id;
 	void *virt_address;
 	dma_addr_t bus_address;
+	void (*complete)(struct mbo *);
+	int *num_buffers_ptr;
+	u16 hdm_channel_id;
 	u16 buffer_length;
+	u16 index;
+	struct sg_table *sgt;
+	struct list_head list;
+
+	/* written by the HDM */
+	void *priv ____cacheline_aligned_in_smp;
 	u16 processed_length;
 	enum mbo_status_flags status;
-	void (*complete)(struct mbo *);
+	ktime_t timestamp;
 };
 
 /**
@@ -268,6 +302,11 @@ struct mbo {
  *   means of "Message exchange over MDP/MEP"
  *   The call of the function request_netinfo with the parameter on_netinfo as
  *   NULL prohibits use of the previously obtained function pointer.
+ * @set_mep_hash: optional, programs the 64 bit multicast hash table of the
+ *   MEP receive filter.  Bit n of the table is bit n % 16 of hash[n / 16];
+ *   a multicast frame passes if the bit selected by the top six bits of the
+ *   CRC-32 (ether_crc()) of its destination address is set.  May be called
+ *   in atomic context.
  * @priv Private field used by mostcore to store context information.
  */
 struct most_interface {
@@ -285,6 +324,7 @@ struct most_interface {
 				void (*on_netinfo)(struct most_interface *iface,
 						   unsigned char link_stat,
 						   unsigned char *mac_addr));
+	void (*set_mep_hash)(struct most_interface *iface, const u16 *hash);
 	void *priv;
 };
 
@@ -295,6 +335,8 @@ struct most_interface {
  * @disconnect_channel: callback function to disconnect a certain channel
  * @rx_completion: completion handler for received packets
  * @tx_completion: completion handler for transmitted packets
+ * @tx_done: optional handler called with each Tx MBO the HDM completed,
+ *	     before the MBO is recycled
  * @context: context pointer to be used by mostcore
  */
 struct most_aim {
@@ -306,6 +348,7 @@ struct most_aim {
 				  int channel_idx);
 	int (*rx_completion)(struct mbo *mbo);
 	int (*tx_completion)(struct most_interface *iface, int channel_idx);
+	void (*tx_done)(struct mbo *mbo);
 	void *context;
 };
 
@@ -346,6 +389,10 @@ void most_deregister_config_set(struct most_config_set *cfg_set);
  *
  * Returns a pointer to the kobject of the generated instance.
  *
+ * The automatic configuration and linking of the channels (see
+ * most_register_config_set) is done asynchronously on a workqueue of the
+ * core, so the function returns without waiting for the AIMs to be probed.
+ *
  * Note: HDM has to ensure that any reference held on the kobj is
  * released before deregistering the interface.
  */
@@ -379,11 +426,16 @@ int most_deregister_aim(struct most_aim *aim);
 struct mbo *most_get_mbo(struct most_interface *iface, int channel_idx,
 			 struct most_aim *);
 void most_put_mbo(struct mbo *mbo);
+struct page *most_detach_mbo_page(struct mbo *mbo, gfp_t gfp);
+int most_mmap_buffers(struct most_interface *iface, int channel_idx,
+		      struct vm_area_struct *vma);
 int channel_has_mbo(struct most_interface *iface, int channel_idx,
 		    struct most_aim *aim);
 int most_start_channel(struct most_interface *iface, int channel_idx,
 		       struct most_aim *);
 int most_stop_channel(struct most_interface *iface, int channel_idx,
 		      struct most_aim *);
+int most_set_num_buffers(struct most_interface *iface, int channel_idx,
+			 u16 num_buffers);
 
 #endif /* MOST_CORE_H_ */